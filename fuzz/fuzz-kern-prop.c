@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Fuzz target for kernel property extraction. Input is property name
+ * and devd message separated by the first newline.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "udev-global.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char *prop, *buf, *value, *nl;
+	size_t len, buflen;
+
+	prop = malloc(size + 1);
+	if (prop == NULL)
+		return (0);
+	memcpy(prop, data, size);
+	prop[size] = '\0';
+
+	nl = strchr(prop, '\n');
+	if (nl == NULL) {
+		free(prop);
+		return (0);
+	}
+	*nl = '\0';
+	buf = nl + 1;
+	buflen = strlen(buf);
+
+	/* Value must lie within the message */
+	value = get_kern_prop_value(buf, prop, &len);
+	if (value != NULL) {
+		assert(value >= buf && value <= buf + buflen);
+		assert(len <= (size_t)(buf + buflen - value));
+		assert(memchr(value, ' ', len) == NULL);
+		(void)match_kern_prop_value(buf, prop, value);
+	}
+
+	free(prop);
+	return (0);
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Standalone driver for fuzz targets when libFuzzer is not available.
+ * Runs target over given files and directories or over stdin, so it
+ * can be used to replay corpus and crashes and as AFL harness.
+ */
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static int
+fuzz_run_stream(FILE *fp)
+{
+	uint8_t *data = NULL, *tmp;
+	size_t size = 0, alloc = 0, n;
+
+	do {
+		if (size == alloc) {
+			alloc = alloc == 0 ? 4096 : alloc * 2;
+			tmp = realloc(data, alloc);
+			if (tmp == NULL) {
+				free(data);
+				return (-1);
+			}
+			data = tmp;
+		}
+		n = fread(data + size, 1, alloc - size, fp);
+		size += n;
+	} while (n != 0);
+
+	LLVMFuzzerTestOneInput(data, size);
+	free(data);
+	return (ferror(fp) ? -1 : 0);
+}
+
+static int
+fuzz_run_path(const char *path)
+{
+	char entpath[PATH_MAX];
+	struct dirent *ent;
+	struct stat st;
+	FILE *fp;
+	DIR *dir;
+	int ret = 0;
+
+	if (stat(path, &st) != 0) {
+		perror(path);
+		return (-1);
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		dir = opendir(path);
+		if (dir == NULL) {
+			perror(path);
+			return (-1);
+		}
+		while ((ent = readdir(dir)) != NULL) {
+			if (ent->d_name[0] == '.')
+				continue;
+			snprintf(entpath, sizeof(entpath), "%s/%s", path,
+			    ent->d_name);
+			if (fuzz_run_path(entpath) != 0)
+				ret = -1;
+		}
+		closedir(dir);
+		return (ret);
+	}
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return (-1);
+	}
+	ret = fuzz_run_stream(fp);
+	if (ret != 0)
+		perror(path);
+	fclose(fp);
+	return (ret);
+}
+
+int
+main(int argc, char **argv)
+{
+	int i, ret = 0;
+
+	if (argc < 2)
+		return (fuzz_run_stream(stdin) == 0 ? 0 : 1);
+
+	for (i = 1; i < argc; i++)
+		if (fuzz_run_path(argv[i]) != 0)
+			ret = 1;
+
+	return (ret);
+}
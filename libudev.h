@@ -184,6 +184,56 @@ struct udev_list_entry *udev_hwdb_get_properties_list_entry(
 
 int udev_util_encode_string(const char *str, char *str_enc, size_t len);
 
+/* libudev-devd extensions */
+int udev_device_get_devnode_devnum(struct udev_device *udev_device,
+    const char **devnode, dev_t *devnum);
+void udev_trace_enable(int enable);
+int udev_trace_dump(int fd);
+int udev_monitor_set_capture(struct udev_monitor *udev_monitor,
+    const char *path);
+int udev_monitor_set_replay(struct udev_monitor *udev_monitor,
+    const char *path, int realtime);
+int udev_enumerate_set_profile(struct udev_enumerate *udev_enumerate,
+    int enable);
+
+/*
+ * Indices of per-subsystem counters. They never change, new subsystems
+ * take the next index below UDEV_STATS_SUBSYSTEM_MAX.
+ */
+enum {
+	UDEV_STATS_OTHER,
+	UDEV_STATS_INPUT,
+	UDEV_STATS_DRM,
+	UDEV_STATS_NET,
+	UDEV_STATS_HIDRAW,
+	UDEV_STATS_PCI,
+	UDEV_STATS_SUBSYSTEM_CNT,
+};
+
+/* Dimension of per-subsystem arrays. Part of ABI, must not change */
+#define	UDEV_STATS_SUBSYSTEM_MAX	16
+
+/* Bucket i counts latencies in [2^i, 2^(i+1)) nanoseconds */
+#define	UDEV_STATS_LATENCY_BUCKETS	32
+
+/* Process-wide counters. New fields are only appended */
+struct udev_stats {
+	unsigned long long devd_received;
+	unsigned long long devd_parsed;
+	unsigned long long devd_dropped;
+	unsigned long long events[UDEV_STATS_SUBSYSTEM_MAX];
+	unsigned long long filter_evaluations;
+	unsigned long long filter_rejections;
+	unsigned long long handler_calls[UDEV_STATS_SUBSYSTEM_MAX];
+	unsigned long long handler_ns[UDEV_STATS_SUBSYSTEM_MAX];
+	unsigned long long enumerate_scans;
+	unsigned long long enumerate_nodes;
+	unsigned long long backend_syscalls;
+	unsigned long long latency[UDEV_STATS_LATENCY_BUCKETS];
+};
+
+int udev_get_stats(struct udev_stats *stats, size_t size);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,1151 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks of library hot paths. Every benchmark prints one JSON
+ * object per line so results can be collected and compared by CI.
+ * Built with library sources to reach internal interfaces.
+ *
+ * Unless -H is given, the library is pointed at generated device tree and
+ * devd socket in temporary directory, so no privileges are needed. Without
+ * CAP_MKNOD nodes are created with zero device number.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#ifdef HAVE_MALLINFO2
+#include <malloc.h>
+#elif defined(__FreeBSD__)
+#include <malloc_np.h>
+#endif
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "udev-global.h"
+
+/* Properties typically set for input device */
+static const char *bench_props[][2] = {
+	{ "DEVNAME", "/dev/input/event3" },
+	{ "SUBSYSTEM", "input" },
+	{ "ID_INPUT", "1" },
+	{ "ID_INPUT_KEY", "1" },
+	{ "ID_INPUT_KEYBOARD", "1" },
+	{ "ID_PATH", "pci-0000:00:14.0-usb-0:3:1.0" },
+	{ "ID_VENDOR_ID", "046d" },
+	{ "ID_MODEL_ID", "c31c" },
+	{ "ID_SERIAL", "Logitech_USB_Keyboard" },
+	{ "ID_BUS", "usb" },
+	{ "MAJOR", "13" },
+	{ "MINOR", "67" },
+	{ "NAME", "\"Logitech USB Keyboard\"" },
+	{ "PRODUCT", "3/46d/c31c/110" },
+	{ "XKBLAYOUT", "us" },
+	{ "ID_INPUT_MOUSE", "1" },
+};
+
+static const char *bench_syspaths[] = {
+	"/dev/input/event0",
+	"/dev/input/event12",
+	"/dev/dri/card0",
+	"/dev/ukbd0",
+	"/dev/psm0",
+	"/dev/hidraw3",
+	"/dev/ttyU0",
+	"/sys/ums0",
+	"/net/em0",
+	"/pci/0000:00:02.0",
+};
+
+static const char *bench_messages[] = {
+	"!system=DEVFS subsystem=CDEV type=CREATE cdev=input/event5",
+	"!system=DEVFS subsystem=CDEV type=DESTROY cdev=input/event5",
+	"!system=DRM subsystem=CDEV type=HOTPLUG cdev=dri/card0",
+	"!system=IFNET subsystem=ue0 type=ATTACH",
+	"+uhid0 at bus=0 sernum=\"\" on uhub1",
+	"-uhid0 at bus=0 sernum=\"\" on uhub1",
+	"+vgapci0 at slot=2 function=0 dbsf=pci0:0:2:0 on pci0",
+	"!system=USB subsystem=DEVICE type=ATTACH ugen=ugen0.2",
+	"!system=ACPI subsystem=Thermal type=notify notify=0x80",
+};
+
+/* Node name templates of synthetic device tree, taken in turn */
+static const char *universe[] = {
+	"input/event%lu",
+	"input/event%lu",
+	"input/event%lu",
+	"hidraw%lu",
+	"ums%lu",
+	"dri/card%lu",
+	"pts/%lu",
+	"ttyu%lu",
+};
+
+static const char *universe_dirs[] = { "dev", "dev/input", "dev/dri", "dev/pts" };
+
+static unsigned long iterations = 100000;
+static unsigned long nodes = 1000;
+static const char *hwdb_tool;	/* udev-hwdb compiler, NULL if not given */
+static const char *fakedevd_tool;	/* devd stand-in, NULL if not given */
+static unsigned long rate = 20000;	/* events per second sent to monitor */
+static char root[] = "/tmp/udev-bench.XXXXXX";
+static char devd_path[sizeof(root) + 16];
+
+static int
+universe_remove_cb(const char *path, const struct stat *st, int flag,
+    struct FTW *ftw)
+{
+
+	return (remove(path));
+}
+
+static void
+universe_remove(void)
+{
+
+	nftw(root, universe_remove_cb, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Populates device tree and relocates library there */
+static void
+universe_create(void)
+{
+	char path[DEV_PATH_MAX * 2], name[DEV_PATH_MAX];
+	unsigned long i;
+	size_t j;
+	dev_t devnum;
+
+	if (mkdtemp(root) == NULL)
+		err(1, "mkdtemp");
+	atexit(universe_remove);
+	for (j = 0; j < nitems(universe_dirs); j++) {
+		snprintf(path, sizeof(path), "%s/%s", root, universe_dirs[j]);
+		if (mkdir(path, 0755) != 0)
+			err(1, "mkdir %s", path);
+	}
+	for (i = 0; i < nodes; i++) {
+		snprintf(name, sizeof(name), universe[i % nitems(universe)], i);
+		snprintf(path, sizeof(path), "%s/dev/%s", root, name);
+		devnum = makedev(200, i);
+		if (mknod(path, S_IFCHR | 0600, devnum) != 0 &&
+		    (errno != EPERM ||
+		     mknod(path, S_IFCHR | 0600, makedev(0, 0)) != 0))
+			err(1, "mknod %s", path);
+	}
+
+	snprintf(devd_path, sizeof(devd_path), "%s/devd.sock", root);
+	setenv("UDEV_DEV_ROOT", root, 1);
+	setenv("UDEV_DEVD_SOCKET", devd_path, 1);
+}
+
+static void
+bench_print(const char *name, unsigned long ops, uint64_t elapsed,
+    const char *extra)
+{
+
+	printf("{\"bench\":\"%s\",\"ops\":%lu,\"ns\":%llu,\"ns_per_op\":%.1f%s}\n",
+	    name, ops, (unsigned long long)elapsed,
+	    ops != 0 ? (double)elapsed / ops : 0.0, extra != NULL ? extra : "");
+	fflush(stdout);
+}
+
+static void
+bench_report(const char *name, unsigned long ops, uint64_t start,
+    const char *extra)
+{
+
+	bench_print(name, ops, udev_stats_now() - start, extra);
+}
+
+static void
+bench_list_insert(struct udev *udev)
+{
+	struct udev_list list;
+	unsigned long i;
+	size_t j;
+	uint64_t start;
+
+	start = udev_stats_now();
+	for (i = 0; i < iterations / nitems(bench_props); i++) {
+		udev_list_init(&list);
+		for (j = 0; j < nitems(bench_props); j++)
+			udev_list_insert(&list, bench_props[j][0],
+			    bench_props[j][1]);
+		udev_list_free(&list);
+	}
+	bench_report("list_insert", i * nitems(bench_props), start, NULL);
+}
+
+/* Heap bytes in use by the process or thread, -1 if unknown */
+static long long
+bench_heap_used(void)
+{
+#ifdef HAVE_MALLINFO2
+
+	return (mallinfo2().uordblks);
+#elif defined(__FreeBSD__)
+	uint64_t allocated, deallocated;
+	size_t len = sizeof(uint64_t);
+
+	if (mallctl("thread.allocated", &allocated, &len, NULL, 0) != 0 ||
+	    mallctl("thread.deallocated", &deallocated, &len, NULL, 0) != 0)
+		return (-1);
+	return (allocated - deallocated);
+#else
+
+	return (-1);
+#endif
+}
+
+/* Heap footprint of property lists of typical input devices */
+static void
+bench_list_memory(struct udev *udev)
+{
+	struct udev_list *lists;
+	unsigned long i, count;
+	long long before, after;
+	size_t j;
+	uint64_t start;
+	char extra[64];
+
+	count = iterations / 100 > 0 ? iterations / 100 : 1;
+	lists = calloc(count, sizeof(struct udev_list));
+	if (lists == NULL)
+		err(1, "calloc");
+
+	before = bench_heap_used();
+	start = udev_stats_now();
+	for (i = 0; i < count; i++) {
+		udev_list_init(&lists[i]);
+		for (j = 0; j < nitems(bench_props); j++)
+			udev_list_insert(&lists[i], bench_props[j][0],
+			    bench_props[j][1]);
+	}
+	after = bench_heap_used();
+	if (before < 0 || after < 0)
+		extra[0] = '\0';
+	else
+		snprintf(extra, sizeof(extra), ",\"bytes_per_entry\":%.1f",
+		    (double)(after - before) / (count * nitems(bench_props)));
+	bench_report("list_memory", count * nitems(bench_props), start, extra);
+
+	for (i = 0; i < count; i++)
+		udev_list_free(&lists[i]);
+	free(lists);
+}
+
+static void
+bench_list_iterate(struct udev *udev)
+{
+	struct udev_list list;
+	struct udev_list_entry *ule;
+	unsigned long i, n = 0;
+	size_t j;
+	uint64_t start;
+
+	udev_list_init(&list);
+	for (j = 0; j < nitems(bench_props); j++)
+		udev_list_insert(&list, bench_props[j][0], bench_props[j][1]);
+
+	start = udev_stats_now();
+	for (i = 0; i < iterations / nitems(bench_props); i++)
+		udev_list_entry_foreach(ule, udev_list_entry_get_first(&list))
+			n += _udev_list_entry_get_value(ule)[0];
+	bench_report("list_iterate", i * nitems(bench_props), start, NULL);
+	udev_list_free(&list);
+	if (n == 0)
+		abort();
+}
+
+static void
+bench_property_lookup(struct udev *udev)
+{
+	struct udev_device *ud;
+	struct udev_list *props;
+	unsigned long i;
+	size_t j;
+	uint64_t start;
+
+	/* Synthetic node does not exist, so device gets no handler data */
+	ud = udev_device_new_common(udev, "/dev/input/event999",
+	    UD_ACTION_NONE);
+	if (ud == NULL)
+		err(1, "udev_device_new_common");
+	props = udev_device_get_properties_list(ud);
+	for (j = 0; j < nitems(bench_props); j++)
+		udev_list_insert(props, bench_props[j][0], bench_props[j][1]);
+
+	start = udev_stats_now();
+	for (i = 0; i < iterations; i++)
+		if (udev_device_get_property_value(ud,
+		    bench_props[i % nitems(bench_props)][0]) == NULL)
+			errx(1, "property %s is lost",
+			    bench_props[i % nitems(bench_props)][0]);
+	bench_report("property_lookup", i, start, NULL);
+	udev_device_unref(ud);
+}
+
+static void
+bench_filter_match(struct udev *udev)
+{
+	struct udev_filter_head filters;
+	unsigned long i, matched = 0;
+	uint64_t start;
+	char extra[32];
+
+	udev_filter_init(&filters);
+	udev_filter_add(&filters, UDEV_FILTER_TYPE_SUBSYSTEM, 0, "input",
+	    NULL);
+	udev_filter_add(&filters, UDEV_FILTER_TYPE_SUBSYSTEM, 0, "drm", NULL);
+	udev_filter_add(&filters, UDEV_FILTER_TYPE_SYSNAME, 1, "event1*",
+	    NULL);
+
+	start = udev_stats_now();
+	for (i = 0; i < iterations; i++)
+		if (udev_filter_match(udev, &filters,
+		    bench_syspaths[i % nitems(bench_syspaths)]))
+			matched++;
+	snprintf(extra, sizeof(extra), ",\"matched\":%lu", matched);
+	bench_report("filter_match", i, start, extra);
+	udev_filter_free(&filters);
+}
+
+static void
+bench_devd_parse(struct udev *udev)
+{
+	char msg[DEV_PATH_MAX * 2], syspath[DEV_PATH_MAX];
+	const char *src;
+	unsigned long i, parsed = 0;
+	uint64_t start;
+	char extra[32];
+
+	start = udev_stats_now();
+	for (i = 0; i < iterations; i++) {
+		/* Parsers are allowed to modify message */
+		src = bench_messages[i % nitems(bench_messages)];
+		strlcpy(msg, src, sizeof(msg));
+		if (parse_devd_message(msg, syspath, sizeof(syspath)) !=
+		    UD_ACTION_NONE)
+			parsed++;
+	}
+	snprintf(extra, sizeof(extra), ",\"parsed\":%lu", parsed);
+	bench_report("devd_parse", i, start, extra);
+}
+
+static void
+bench_enumerate(struct udev *udev)
+{
+	struct udev_enumerate *ue;
+	struct udev_list_entry *ule;
+	unsigned long i, rounds, found = 0;
+	uint64_t start;
+	char extra[32];
+
+	/* Whole tree walk is thousand times heavier than other benchmarks */
+	rounds = iterations / 1000 > 0 ? iterations / 1000 : 1;
+	start = udev_stats_now();
+	for (i = 0; i < rounds; i++) {
+		ue = udev_enumerate_new(udev);
+		if (ue == NULL || udev_enumerate_scan_devices(ue) < 0)
+			err(1, "udev_enumerate_scan_devices");
+		found = 0;
+		udev_list_entry_foreach(ule, udev_enumerate_get_list_entry(ue))
+			found++;
+		udev_enumerate_unref(ue);
+	}
+	snprintf(extra, sizeof(extra), ",\"nodes\":%lu", found);
+	bench_report("enumerate", i, start, extra);
+}
+
+/*
+ * Heap footprint of devices of one enumeration of the device tree, with
+ * their properties and sysattrs. -N sets number of devices.
+ */
+static void
+bench_enumerate_memory(struct udev *udev)
+{
+	struct udev_enumerate *ue;
+	struct udev_list_entry *ule, *e;
+	struct udev_device **uds;
+	unsigned long i, found = 0, entries = 0;
+	long long before, after;
+	uint64_t start;
+	char extra[96];
+
+	uds = calloc(nodes, sizeof(struct udev_device *));
+	if (uds == NULL)
+		err(1, "calloc");
+
+	before = bench_heap_used();
+	start = udev_stats_now();
+	ue = udev_enumerate_new(udev);
+	if (ue == NULL || udev_enumerate_scan_devices(ue) < 0)
+		err(1, "udev_enumerate_scan_devices");
+	udev_list_entry_foreach(ule, udev_enumerate_get_list_entry(ue)) {
+		if (found == nodes)
+			break;
+		uds[found] = udev_device_new_from_syspath(udev,
+		    udev_list_entry_get_name(ule));
+		if (uds[found] == NULL)
+			continue;
+		udev_list_entry_foreach(e,
+		    udev_device_get_properties_list_entry(uds[found]))
+			entries++;
+		udev_list_entry_foreach(e,
+		    udev_device_get_sysattr_list_entry(uds[found]))
+			entries++;
+		found++;
+	}
+	after = bench_heap_used();
+	if (before < 0 || after < 0 || found == 0)
+		snprintf(extra, sizeof(extra), ",\"nodes\":%lu", found);
+	else
+		snprintf(extra, sizeof(extra), ",\"nodes\":%lu,\"entries\":%lu,"
+		    "\"bytes_per_device\":%.1f", found, entries,
+		    (double)(after - before) / found);
+	bench_report("enumerate_memory", found, start, extra);
+
+	udev_enumerate_unref(ue);
+	for (i = 0; i < found; i++)
+		udev_device_unref(uds[i]);
+	free(uds);
+}
+
+/*
+ * Finds descriptors of character devices opened by process. Misses are
+ * devices not opened, like most of probed ones.
+ */
+static void
+bench_fd_lookup(struct udev *udev)
+{
+	static const char *modes[] = { "hit", "miss" };
+	unsigned long i;
+	uint64_t start;
+	size_t m;
+	int fds[64], j, fd;
+	char extra[32];
+
+	for (j = 0; j < (int)nitems(fds); j++)
+		if ((fds[j] = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+			err(1, "/dev/null");
+	for (m = 0; m < nitems(modes); m++) {
+		start = udev_stats_now();
+		for (i = 0; i < iterations; i++) {
+			fd = path_to_fd(m == 0 ? "/dev/null" : "/dev/zero");
+			if ((fd >= 0) != (m == 0))
+				errx(1, "unexpected path_to_fd %s result",
+				    modes[m]);
+		}
+		snprintf(extra, sizeof(extra), ",\"lookup\":\"%s\"",
+		    modes[m]);
+		bench_report("fd_lookup", i, start, extra);
+	}
+	for (j = 0; j < (int)nitems(fds); j++)
+		close(fds[j]);
+}
+
+/* Looks up interfaces in snapshot filled with 10, 100 and 1000 fakes */
+static void
+bench_net_lookup(struct udev *udev)
+{
+	static const size_t counts[] = { 10, 100, 1000 };
+	struct net_snapshot *ns;
+	struct net_iface *ifaces;
+	char name[IFNAMSIZ];
+	unsigned long i;
+	uint64_t start;
+	size_t c, j;
+	char extra[64];
+
+	ns = udev_get_net_snapshot(udev);
+	for (c = 0; c < nitems(counts); c++) {
+		ifaces = calloc(counts[c], sizeof(struct net_iface));
+		if (ifaces == NULL)
+			err(1, "calloc");
+		for (j = 0; j < counts[c]; j++) {
+			snprintf(ifaces[j].name, IFNAMSIZ, "fake%u",
+			    (unsigned int)j);
+			ifaces[j].ifindex = j + 1;
+		}
+		net_snapshot_fill(ns, ifaces, counts[c]);
+		free(ifaces);
+
+		start = udev_stats_now();
+		for (i = 0; i < iterations; i++) {
+			snprintf(name, sizeof(name), "fake%u",
+			    (unsigned int)(i % counts[c]));
+			if (!udev_net_exists(udev, name))
+				errx(1, "interface %s is lost", name);
+		}
+		snprintf(extra, sizeof(extra),
+		    ",\"interfaces\":%zu,\"validation\":\"%s\"", counts[c],
+		    ns->events >= 0 ? "events" : "ifindex");
+		bench_report("net_lookup", i, start, extra);
+	}
+	net_snapshot_invalidate(ns);
+}
+
+#if defined(__linux__) && !defined(HAVE_DEVINFO_H)
+/* Generates sysfs-like directory of PCI functions with config headers */
+static void
+pci_fixture_create(const char *dir, unsigned long count)
+{
+	char path[DEV_PATH_MAX * 2];
+	uint8_t cfg[64];
+	unsigned long i;
+	FILE *fp;
+
+	if (mkdir(dir, 0755) != 0)
+		err(1, "mkdir %s", dir);
+	memset(cfg, 0, sizeof(cfg));
+	cfg[0x00] = 0x86;
+	cfg[0x01] = 0x80;
+	cfg[0x0b] = 0x03;
+	for (i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/0000:%02lx:%02lx.%lx", dir,
+		    i / 256 % 256, i / 8 % 32, i % 8);
+		if (mkdir(path, 0755) != 0)
+			err(1, "mkdir %s", path);
+		strlcat(path, "/config", sizeof(path));
+		cfg[0x02] = i & 0xff;
+		cfg[0x03] = i >> 8 & 0xff;
+		fp = fopen(path, "w");
+		if (fp == NULL || fwrite(cfg, sizeof(cfg), 1, fp) != 1)
+			err(1, "%s", path);
+		fclose(fp);
+	}
+}
+
+/*
+ * Enumerates PCI functions of generated directory given by UDEV_PCI_PATH
+ * and checks that devices get data of their config headers.
+ */
+static void
+bench_pci_table(struct udev *udev)
+{
+	char dir[sizeof(root) + 8], id[16];
+	struct udev *ctx;
+	struct udev_enumerate *ue;
+	struct udev_list_entry *ule;
+	struct udev_device *ud;
+	unsigned long i, rounds, count, found = 0;
+	const char *value;
+	uint64_t start;
+	char extra[32];
+
+	if (udev_get_dev_root(udev)[0] == '\0') {
+		warnx("pci_table needs synthetic tree");
+		return;
+	}
+	count = nodes < 65536 ? nodes : 65536;
+	snprintf(dir, sizeof(dir), "%s/pci", root);
+	pci_fixture_create(dir, count);
+	setenv("UDEV_PCI_PATH", dir, 1);
+	ctx = udev_new();
+	unsetenv("UDEV_PCI_PATH");
+	if (ctx == NULL)
+		err(1, "udev_new");
+
+	rounds = iterations / 1000 > 0 ? iterations / 1000 : 1;
+	start = udev_stats_now();
+	for (i = 0; i < rounds; i++) {
+		ue = udev_enumerate_new(ctx);
+		if (ue == NULL ||
+		    udev_enumerate_add_match_subsystem(ue, "pci") < 0 ||
+		    udev_enumerate_scan_devices(ue) < 0)
+			err(1, "udev_enumerate_scan_devices");
+		found = 0;
+		udev_list_entry_foreach(ule,
+		    udev_enumerate_get_list_entry(ue)) {
+			ud = udev_device_new_from_syspath(ctx,
+			    udev_list_entry_get_name(ule));
+			if (ud == NULL)
+				errx(1, "%s is not created",
+				    udev_list_entry_get_name(ule));
+			snprintf(id, sizeof(id), "8086:%04lx", found);
+			value = udev_device_get_property_value(ud, "PCI_ID");
+			if (value == NULL || strcmp(value, id) != 0)
+				errx(1, "%s has PCI_ID %s, not %s",
+				    udev_list_entry_get_name(ule), value, id);
+			udev_device_unref(ud);
+			found++;
+		}
+		udev_enumerate_unref(ue);
+	}
+	if (found != count)
+		errx(1, "%lu PCI functions found, not %lu", found, count);
+	snprintf(extra, sizeof(extra), ",\"functions\":%lu", found);
+	bench_report("pci_table", i, start, extra);
+	udev_unref(ctx);
+}
+#endif
+
+#define	HWDB_BENCH_ENTRIES	100000
+
+/* Runs udev-hwdb to compile src into bin */
+static void
+hwdb_compile(const char *src, const char *bin)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0)
+		err(1, "fork");
+	if (pid == 0) {
+		execl(hwdb_tool, hwdb_tool, "-s", "-o", bin, src, (char *)NULL);
+		err(127, "%s", hwdb_tool);
+	}
+	if (waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "%s failed to compile %s", hwdb_tool, src);
+}
+
+/*
+ * Compiles database of HWDB_BENCH_ENTRIES glob records and looks them up.
+ * Every lookup checks value read back, so it is a round trip test of the
+ * trie compiler as well.
+ */
+static void
+bench_hwdb(struct udev *udev)
+{
+	char src[sizeof(root) + 16], bin[sizeof(root) + 16];
+	char modalias[64], expect[16], extra[32];
+	struct udev_hwdb *uh;
+	struct udev_list_entry *ule;
+	unsigned long i, n;
+	const char *value;
+	uint64_t start;
+	FILE *fp;
+
+	if (hwdb_tool == NULL || udev_get_dev_root(udev)[0] == '\0') {
+		warnx("hwdb needs -T udev-hwdb and synthetic tree");
+		return;
+	}
+	snprintf(src, sizeof(src), "%s/bench.hwdb", root);
+	snprintf(bin, sizeof(bin), "%s/hwdb.bin", root);
+	fp = fopen(src, "w");
+	if (fp == NULL)
+		err(1, "%s", src);
+	for (n = 0; n < HWDB_BENCH_ENTRIES; n++)
+		fprintf(fp, "evdev:input:b0003v%04lXp%04lX*\n ID_BENCH=%lu\n\n",
+		    n / 256, n % 256, n);
+	if (fclose(fp) != 0)
+		err(1, "%s", src);
+	hwdb_compile(src, bin);
+
+	setenv("UDEV_HWDB_BIN", bin, 1);
+	uh = udev_hwdb_new(udev);
+	unsetenv("UDEV_HWDB_BIN");
+	if (uh == NULL)
+		err(1, "udev_hwdb_new");
+
+	if (udev_hwdb_get_properties_list_entry(uh,
+	    "evdev:input:b0005v0001p0001e0001", 0) != NULL)
+		errx(1, "bluetooth modalias matches usb records");
+
+	start = udev_stats_now();
+	for (i = 0; i < iterations; i++) {
+		/* Stride spreads lookups over the whole trie */
+		n = i * 7919 % HWDB_BENCH_ENTRIES;
+		snprintf(modalias, sizeof(modalias),
+		    "evdev:input:b0003v%04lXp%04lXe0110-e0,1,4", n / 256,
+		    n % 256);
+		snprintf(expect, sizeof(expect), "%lu", n);
+		ule = udev_hwdb_get_properties_list_entry(uh, modalias, 0);
+		ule = udev_list_entry_get_by_name(ule, "ID_BENCH");
+		value = ule != NULL ? udev_list_entry_get_value(ule) : NULL;
+		if (value == NULL || strcmp(value, expect) != 0)
+			errx(1, "%s: ID_BENCH is %s, not %s", modalias,
+			    value != NULL ? value : "missing", expect);
+	}
+	snprintf(extra, sizeof(extra), ",\"entries\":%d", HWDB_BENCH_ENTRIES);
+	bench_report("hwdb_lookup", i, start, extra);
+	udev_hwdb_unref(uh);
+}
+
+/* Creates devices for enumerated syspaths with parent cache on and off */
+static void
+bench_device_create(struct udev *udev)
+{
+#ifdef HAVE_SYSCTLBYNAME
+	static const char *modes[] = { "on", "off" };
+#else
+	/* Parent cache is built only along with sysctl device descriptions */
+	static const char *modes[] = { NULL };
+#endif
+	struct udev *ctx;
+	struct udev_enumerate *ue;
+	struct udev_list_entry *ule;
+	struct udev_device *ud;
+	unsigned long i, rounds, created;
+	uint64_t start;
+	size_t m;
+	char extra[64];
+
+	rounds = iterations / 1000 > 0 ? iterations / 1000 : 1;
+	for (m = 0; m < nitems(modes); m++) {
+		if (modes[m] != NULL)
+			setenv("UDEV_PARENT_CACHE", m == 0 ? "1" : "0", 1);
+		ctx = udev_new();
+		if (ctx == NULL)
+			err(1, "udev_new");
+		ue = udev_enumerate_new(ctx);
+		if (ue == NULL || udev_enumerate_scan_devices(ue) < 0)
+			err(1, "udev_enumerate_scan_devices");
+		created = 0;
+		start = udev_stats_now();
+		for (i = 0; i < rounds; i++) {
+			udev_list_entry_foreach(ule,
+			    udev_enumerate_get_list_entry(ue)) {
+				ud = udev_device_new_from_syspath(ctx,
+				    udev_list_entry_get_name(ule));
+				if (ud == NULL)
+					continue;
+				udev_device_unref(ud);
+				created++;
+			}
+		}
+		if (modes[m] != NULL)
+			snprintf(extra, sizeof(extra),
+			    ",\"parent_cache\":\"%s\"", modes[m]);
+		else
+			extra[0] = '\0';
+		bench_report("device_create", created, start, extra);
+		udev_enumerate_unref(ue);
+		udev_unref(ctx);
+	}
+	unsetenv("UDEV_PARENT_CACHE");
+}
+
+static int
+bench_scandir_cb(const char *path, int dirfd, const char *name, mode_t type,
+    void *args)
+{
+
+	(*(unsigned long *)args)++;
+	return (0);
+}
+
+/* Raw directory walk of device tree, -N 50000 gives a large one */
+static void
+bench_scandir(struct udev *udev)
+{
+	char path[DEV_PATH_MAX * 2];
+	unsigned long i, rounds, found = 0;
+	struct scandir_ctx ctx = {
+		.recursive = true,
+		.cb = bench_scandir_cb,
+		.args = &found,
+	};
+	uint64_t start;
+	char extra[32];
+
+	rounds = iterations / 1000 > 0 ? iterations / 1000 : 1;
+	start = udev_stats_now();
+	for (i = 0; i < rounds; i++) {
+		found = 0;
+		snprintf(path, sizeof(path), "%s/dev/",
+		    udev_get_dev_root(udev));
+		if (scandir_recursive(path, sizeof(path), &ctx) != 0)
+			err(1, "scandir_recursive");
+	}
+	snprintf(extra, sizeof(extra), ",\"nodes\":%lu", found);
+	bench_report("scandir", i, start, extra);
+}
+
+static int
+latency_cmp(const void *a, const void *b)
+{
+	uint64_t l1 = *(const uint64_t *)a, l2 = *(const uint64_t *)b;
+
+	return (l1 < l2 ? -1 : l1 > l2);
+}
+
+/* Round trip of devd message to udev_monitor_receive_device() */
+static void
+bench_monitor_latency(struct udev *udev)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct udev_monitor *um;
+	struct udev_device *ud;
+	struct pollfd pfd;
+	char msg[128], extra[64];
+	unsigned long i, rounds;
+	uint64_t *lat, start, total = 0;
+	int lfd, cfd;
+	size_t len;
+
+	/* Real devd can not be fed with synthetic events */
+	if (devd_path[0] == '\0')
+		return;
+
+	rounds = iterations / 100 > 0 ? iterations / 100 : 1;
+	lat = calloc(rounds, sizeof(uint64_t));
+	if (lat == NULL)
+		err(1, "calloc");
+
+	strlcpy(sa.sun_path, devd_path, sizeof(sa.sun_path));
+	lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+	    listen(lfd, 1) != 0)
+		err(1, "%s", devd_path);
+
+	um = udev_monitor_new_from_netlink(udev, "udev");
+	if (um == NULL ||
+	    udev_monitor_filter_add_match_subsystem_devtype(um, "input",
+	    NULL) < 0 ||
+	    udev_monitor_enable_receiving(um) < 0)
+		errx(1, "can not start monitor");
+	cfd = accept(lfd, NULL, NULL);
+	if (cfd < 0)
+		err(1, "accept");
+
+	pfd.fd = udev_monitor_get_fd(um);
+	pfd.events = POLLIN;
+	for (i = 0; i < rounds; i++) {
+		len = snprintf(msg, sizeof(msg), "!system=DEVFS subsystem=CDEV "
+		    "type=CREATE cdev=input/event%lu\n",
+		    i * nitems(universe) % nodes);
+		start = udev_stats_now();
+		if (send(cfd, msg, len, 0) != (ssize_t)len)
+			err(1, "send");
+		if (poll(&pfd, 1, 1000) != 1)
+			errx(1, "event is lost");
+		ud = udev_monitor_receive_device(um);
+		lat[i] = udev_stats_now() - start;
+		if (ud == NULL)
+			errx(1, "event is lost");
+		udev_device_unref(ud);
+		total += lat[i];
+	}
+
+	qsort(lat, rounds, sizeof(uint64_t), latency_cmp);
+	snprintf(extra, sizeof(extra), ",\"p50_ns\":%llu,\"p99_ns\":%llu",
+	    (unsigned long long)lat[rounds / 2],
+	    (unsigned long long)lat[rounds * 99 / 100]);
+	bench_print("monitor_latency", rounds, total, extra);
+
+	udev_monitor_unref(um);
+	close(cfd);
+	close(lfd);
+	free(lat);
+}
+
+/* Upper bound of log2 latency bucket below which pct percent of events are */
+static unsigned long long
+latency_percentile(const unsigned long long *hist, unsigned long long total,
+    int pct)
+{
+	unsigned long long cum = 0;
+	int i;
+
+	for (i = 0; i < UDEV_STATS_LATENCY_BUCKETS; i++) {
+		cum += hist[i];
+		if (cum * 100 >= total * pct)
+			return (2ULL << i);
+	}
+
+	return (0);
+}
+
+/*
+ * Consumer side of monitor under load. udev-fakedevd sends generated events
+ * at -R rate while monitor is drained. Latencies come from udev_get_stats()
+ * buckets. Lost events are those not read from socket, as devd drops them
+ * for slow clients, and parsed ones never delivered. Messages which do not
+ * describe a device, like bus attach lines, are not delivered by design.
+ */
+static void
+bench_monitor_load(struct udev *udev)
+{
+	struct udev_stats before, after;
+	unsigned long long hist[UDEV_STATS_LATENCY_BUCKETS], total = 0;
+	char count[32], ratestr[32], extra[192];
+	struct udev_monitor *um;
+	struct udev_device *ud;
+	struct pollfd pfd;
+	struct stat st;
+	unsigned long events, delivered = 0, received, parsed, lost;
+	uint64_t start, last;
+	pid_t pid;
+	int i, status, null_fd;
+	bool done = false;
+
+	if (fakedevd_tool == NULL || devd_path[0] == '\0') {
+		warnx("monitor_load needs -F udev-fakedevd and synthetic tree");
+		return;
+	}
+
+	events = iterations / 10 > 0 ? iterations / 10 : 1;
+	snprintf(count, sizeof(count), "%lu", events);
+	snprintf(ratestr, sizeof(ratestr), "%lu", rate);
+	/* Socket left by other benchmarks would look like a bound one */
+	unlink(devd_path);
+	pid = fork();
+	if (pid < 0)
+		err(1, "fork");
+	if (pid == 0) {
+		null_fd = open("/dev/null", O_WRONLY);
+		if (null_fd >= 0)
+			dup2(null_fd, STDERR_FILENO);
+		execl(fakedevd_tool, fakedevd_tool, "-c", "1", "-g", count,
+		    "-r", ratestr, "-s", devd_path, (char *)NULL);
+		err(127, "%s", fakedevd_tool);
+	}
+	for (i = 0; i < 1000 && stat(devd_path, &st) != 0; i++)
+		usleep(1000);
+
+	um = udev_monitor_new_from_netlink(udev, "udev");
+	if (um == NULL || udev_monitor_enable_receiving(um) < 0)
+		errx(1, "can not start monitor");
+	udev_get_stats(&before, sizeof(before));
+
+	pfd.fd = udev_monitor_get_fd(um);
+	pfd.events = POLLIN;
+	start = last = udev_stats_now();
+	for (;;) {
+		if (poll(&pfd, 1, 100) == 1) {
+			ud = udev_monitor_receive_device(um);
+			if (ud != NULL) {
+				/* Monitor may take a while to reconnect */
+				if (delivered++ == 0)
+					start = udev_stats_now();
+				last = udev_stats_now();
+				udev_device_unref(ud);
+			}
+			continue;
+		}
+		/* Sender is gone and queue stayed empty for a while */
+		if (done)
+			break;
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				errx(1, "%s failed", fakedevd_tool);
+			done = true;
+		}
+	}
+	udev_get_stats(&after, sizeof(after));
+	udev_monitor_unref(um);
+
+	for (i = 0; i < UDEV_STATS_LATENCY_BUCKETS; i++) {
+		hist[i] = after.latency[i] - before.latency[i];
+		total += hist[i];
+	}
+	received = after.devd_received - before.devd_received;
+	parsed = after.devd_parsed - before.devd_parsed;
+	lost = (received < events ? events - received : 0) +
+	    (parsed > delivered ? parsed - delivered : 0);
+	snprintf(extra, sizeof(extra), ",\"rate\":%lu,\"received\":%lu,"
+	    "\"delivered\":%lu,\"lost\":%lu,\"p50_ns\":%llu,\"p99_ns\":%llu",
+	    rate, received, delivered, lost,
+	    latency_percentile(hist, total, 50),
+	    latency_percentile(hist, total, 99));
+	bench_print("monitor_load", events, last - start, extra);
+}
+
+/* Parse, filter and construct pipeline fed from capture at full speed */
+static void
+bench_monitor_replay(struct udev *udev)
+{
+	char path[sizeof(root) + 16], line[128], syspath[DEV_PATH_MAX];
+	struct udev_monitor *um;
+	struct udev_device *ud;
+	struct pollfd pfd;
+	unsigned long i, expected = 0, received = 0;
+	uint64_t start;
+	int fd, action;
+
+	if (devd_path[0] == '\0')
+		return;
+
+	snprintf(path, sizeof(path), "%s/replay.cap", root);
+	fd = capture_open(path);
+	if (fd < 0)
+		errx(1, "can not create capture");
+	for (i = 0; i < iterations / 10; i++) {
+		if (i % 4 == 3)
+			strlcpy(line, bench_messages[i % nitems(bench_messages)],
+			    sizeof(line));
+		else
+			snprintf(line, sizeof(line), "!system=DEVFS "
+			    "subsystem=CDEV type=%s cdev=input/event%lu",
+			    i % 2 ? "DESTROY" : "CREATE",
+			    i * nitems(universe) % nodes);
+		strlcpy(syspath, line, sizeof(syspath));
+		action = parse_devd_message(syspath, syspath, sizeof(syspath));
+		if (action != UD_ACTION_NONE &&
+		    strcmp(get_subsystem_by_syspath(syspath, NULL), "input") == 0)
+			expected++;
+		capture_write(fd, i * 1000, line, strlen(line), action, NULL);
+	}
+	close(fd);
+
+	um = udev_monitor_new_from_netlink(udev, "udev");
+	if (um == NULL ||
+	    udev_monitor_filter_add_match_subsystem_devtype(um, "input",
+	    NULL) < 0 ||
+	    udev_monitor_set_replay(um, path, 0) < 0)
+		errx(1, "can not create monitor");
+
+	start = udev_stats_now();
+	if (udev_monitor_enable_receiving(um) < 0)
+		errx(1, "can not start monitor");
+	pfd.fd = udev_monitor_get_fd(um);
+	pfd.events = POLLIN;
+	while (received < expected && poll(&pfd, 1, 1000) == 1) {
+		ud = udev_monitor_receive_device(um);
+		if (ud == NULL)
+			continue;
+		received++;
+		udev_device_unref(ud);
+	}
+	if (received != expected)
+		errx(1, "%lu of %lu events replayed", received, expected);
+	bench_report("monitor_replay", i, start, NULL);
+
+	udev_monitor_unref(um);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(struct udev *udev);
+} benches[] = {
+	{ "list_insert", bench_list_insert },
+	{ "list_iterate", bench_list_iterate },
+	{ "list_memory", bench_list_memory },
+	{ "property_lookup", bench_property_lookup },
+	{ "filter_match", bench_filter_match },
+	{ "devd_parse", bench_devd_parse },
+	{ "scandir", bench_scandir },
+	{ "enumerate", bench_enumerate },
+	{ "enumerate_memory", bench_enumerate_memory },
+	{ "device_create", bench_device_create },
+	{ "fd_lookup", bench_fd_lookup },
+	{ "net_lookup", bench_net_lookup },
+	{ "hwdb_lookup", bench_hwdb },
+#if defined(__linux__) && !defined(HAVE_DEVINFO_H)
+	{ "pci_table", bench_pci_table },
+#endif
+	{ "monitor_latency", bench_monitor_latency },
+	{ "monitor_load", bench_monitor_load },
+	{ "monitor_replay", bench_monitor_replay },
+};
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: udev-bench [-H] [-F udev-fakedevd] [-N nodes] "
+	    "[-n iterations] [-R rate] [-T udev-hwdb] [benchmark ...]\n");
+	exit(1);
+}
+
+/* Positive decimal option argument, anything else is a usage error */
+static unsigned long
+parse_count(const char *arg)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+	if (!isdigit((unsigned char)arg[0]) || *end != '\0' || errno != 0 ||
+	    val == 0)
+		usage();
+	return (val);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct udev *udev;
+	size_t i;
+	int ch, j;
+	bool host = false;
+
+	while ((ch = getopt(argc, argv, "F:HN:n:R:T:")) != -1) {
+		switch (ch) {
+		case 'F':
+			fakedevd_tool = optarg;
+			break;
+		case 'H':
+			host = true;
+			break;
+		case 'N':
+			nodes = parse_count(optarg);
+			break;
+		case 'n':
+			iterations = parse_count(optarg);
+			break;
+		case 'R':
+			rate = parse_count(optarg);
+			break;
+		case 'T':
+			hwdb_tool = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (!host)
+		universe_create();
+	udev = udev_new();
+	if (udev == NULL)
+		err(1, "udev_new");
+
+	for (i = 0; i < nitems(benches); i++) {
+		if (argc == 0) {
+			benches[i].run(udev);
+			continue;
+		}
+		for (j = 0; j < argc; j++)
+			if (strcmp(argv[j], benches[i].name) == 0)
+				benches[i].run(udev);
+	}
+
+	udev_unref(udev);
+	return (0);
+}
@@ -36,6 +36,7 @@
 #include <fcntl.h>
 #include <fnmatch.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -69,6 +70,7 @@
 #else	/* !HAVE_LINUX_INPUT_H */
 #define	BUS_PCI		0x01
 #define	BUS_USB		0x03
+#define	BUS_BLUETOOTH	0x05
 #define	BUS_VIRTUAL	0x06
 #define	BUS_ISA		0x10
 #define	BUS_I8042	0x11
@@ -95,15 +97,21 @@ enum {
 	IT_SWITCH,
 };
 
+struct dev_enumerate_args {
+	struct udev_enumerate *ue;
+	size_t root_len;	/* walked path prefix not in syspath */
+};
+
 static int
-udev_dev_enumerate_cb(const char *path, mode_t type, void *arg)
+udev_dev_enumerate_cb(const char *path, int dirfd, const char *name,
+    mode_t type, void *arg)
 {
-	struct udev_enumerate *ue = arg;
+	struct dev_enumerate_args *args = arg;
 	const char *syspath;
 
 	if (S_ISLNK(type) || S_ISCHR(type)) {
-		syspath = get_syspath_by_devpath(path);
-		return (udev_enumerate_add_device(ue, syspath));
+		syspath = get_syspath_by_devpath(path + args->root_len);
+		return (udev_enumerate_add_device(args->ue, syspath));
 	}
 	return (0);
 }
@@ -111,13 +119,19 @@ udev_dev_enumerate_cb(const char *path, mode_t type, void *arg)
 int
 udev_dev_enumerate(struct udev_enumerate *ue)
 {
-	char path[DEV_PATH_MAX] = DEV_PATH_ROOT "/";
+	char path[DEV_PATH_MAX];
+	const char *root = udev_get_dev_root(udev_enumerate_get_udev(ue));
+	struct dev_enumerate_args args = {
+		.ue = ue,
+		.root_len = strlen(root),
+	};
 	struct scandir_ctx ctx = {
 		.recursive = true,
 		.cb = udev_dev_enumerate_cb,
-		.args = ue,
+		.args = &args,
 	};
 
+	snprintf(path, sizeof(path), "%s" DEV_PATH_ROOT "/", root);
 	return (scandir_recursive(path, sizeof(path), &ctx));
 }
 
@@ -203,15 +217,14 @@ set_input_device_type(struct udev_device *ud, int input_type)
 }
 
 static struct udev_device *
-create_xorg_parent(struct udev_device *ud, const char* sysname,
-    const char *name, const char *product, const char *pnp_id)
+new_xorg_parent(struct udev *udev, const char* sysname,
+    const char *name, const char *product, const char *pnp_id,
+    const char *uevent)
 {
 	struct udev_device *parent;
-	struct udev *udev;
 	struct udev_list *props, *sysattrs;
 
 	/* xorg-server gets device name and vendor string from parent device */
-	udev = udev_device_get_udev(ud);
 	parent = udev_device_new_common(udev, sysname, UD_ACTION_NONE);
 	if (parent == NULL)
 		return NULL;
@@ -224,10 +237,46 @@ create_xorg_parent(struct udev_device *ud, const char* sysname,
 		udev_list_insert(props, "PRODUCT", product);
 	if (pnp_id != NULL)
 		udev_list_insert(sysattrs, "id", product);
+	/* hidapi gets HID description from uevent of parent device */
+	if (uevent != NULL)
+		udev_list_insert(sysattrs, "uevent", uevent);
 
 	return (parent);
 }
 
+/*
+ * Several nodes can be exposed by the same physical device. Share parent
+ * between them only if it carries exactly the same description, as
+ * xorg-server and hidapi read it from the parent.
+ */
+static struct udev_device *
+create_xorg_parent(struct udev_device *ud, const char* sysname,
+    const char *name, const char *product, const char *pnp_id,
+    const char *uevent)
+{
+	struct udev_device *parent;
+	struct udev *udev;
+	char key[DEV_PATH_MAX * 8];
+
+	udev = udev_device_get_udev(ud);
+	if (snprintf(key, sizeof(key),
+	    "%s\nNAME=%s\nPRODUCT=%s\nID=%s\nUEVENT=%s", sysname, name,
+	    product != NULL ? product : "", pnp_id != NULL ? pnp_id : "",
+	    uevent != NULL ? uevent : "") >= (int)sizeof(key))
+		return (new_xorg_parent(udev, sysname, name, product, pnp_id,
+		    uevent));
+
+	parent = udev_device_cache_get(udev, key);
+	if (parent != NULL)
+		return (parent);
+
+	parent = new_xorg_parent(udev, sysname, name, product, pnp_id, uevent);
+	if (parent == NULL)
+		return (NULL);
+
+	return (udev_device_cache_add(udev, key, parent));
+}
+
 #ifdef HAVE_LINUX_INPUT_H
 
 #define	LONG_BITS	(sizeof(long) * 8)
@@ -255,8 +304,8 @@ void
 create_evdev_handler(struct udev_device *ud)
 {
 	struct udev_device *parent;
-	const char *sysname;
-	char name[80], product[80], phys[80];
+	const char *sysname, *hid_uevent;
+	char name[80], product[80], phys[80], uniq[32], uevent[256];
 	int fd = -1, input_type = IT_NONE;
 	bool opened = false;
 	bool has_keys, has_buttons, has_lmr, has_dpad, has_joy_axes;
@@ -286,6 +335,12 @@ create_evdev_handler(struct udev_device *ud)
 	if (sysctlbyname(mib, phys, &len, NULL, 0) < 0)
 		goto use_ioctl;
 
+	/* Not every device has unique id */
+	snprintf(mib, sizeof(mib), "kern.evdev.input.%s.uniq", unit);
+	len = sizeof(uniq);
+	if (sysctlbyname(mib, uniq, &len, NULL, 0) < 0)
+		uniq[0] = '\0';
+
 	snprintf(mib, sizeof(mib), "kern.evdev.input.%s.id", unit);
 	len = sizeof(id);
 	if (sysctlbyname(mib, &id, &len, NULL, 0) < 0)
@@ -342,6 +397,8 @@ use_ioctl:
 		ERR("could not query evdev");
 		goto bail_out;
 	}
+	if (ioctl(fd, EVIOCGUNIQ(sizeof(uniq)), uniq) < 0)
+		uniq[0] = '\0';
 
 #ifdef HAVE_SYSCTLBYNAME
 found_values:
@@ -425,10 +482,35 @@ detected:
 
 	*(strchrnul(name, ',')) = '\0';	/* strip name */
 
-	snprintf(product, sizeof(product), "%x/%x/%x/%x",
+	/* hwdb keys as used by systemd rules */
+	udev_device_add_modalias(ud, "evdev:input:b%04Xv%04Xp%04Xe%04X",
 	    id.bustype, id.vendor, id.product, id.version);
+	if (id.bustype == BUS_USB)
+		udev_device_add_modalias(ud, "usb:v%04Xp%04X",
+		    id.vendor, id.product);
+	if ((input_type == IT_MOUSE || input_type == IT_TOUCHPAD) &&
+	    (id.bustype == BUS_USB || id.bustype == BUS_BLUETOOTH))
+		udev_device_add_modalias(ud, "mouse:%s:v%04xp%04x:name:%s:",
+		    id.bustype == BUS_USB ? "usb" : "bluetooth",
+		    id.vendor, id.product, name);
 
-	parent = create_xorg_parent(ud, sysname, name, product, NULL);
+	snprintf(product, sizeof(product), "%x/%x/%x/%x",
+	    id.bustype, id.vendor, id.product, id.version);
+	/* HID description of parent as hidraw nodes provide it */
+	if (id.bustype == BUS_USB || id.bustype == BUS_BLUETOOTH)
+		snprintf(uevent, sizeof(uevent), "HID_ID=%04X:%08X:%08X\n"
+		    "HID_NAME=%s\nHID_PHYS=%s\nHID_UNIQ=%s", id.bustype,
+		    id.vendor, id.product, name, phys, uniq);
+
+	hid_uevent = id.bustype == BUS_USB || id.bustype == BUS_BLUETOOTH ?
+	    uevent : NULL;
+	/* Virtual devices have no location to tell them apart */
+	if (sysname == virtual_sysname)
+		parent = new_xorg_parent(udev_device_get_udev(ud), sysname,
+		    name, product, NULL, hid_uevent);
+	else
+		parent = create_xorg_parent(ud, sysname, name, product, NULL,
+		    hid_uevent);
 	if (parent != NULL)
 		udev_device_set_parent(ud, parent);
 
@@ -438,46 +520,169 @@ bail_out:
 }
 #endif
 
-static void
-set_parent(struct udev_device *ud)
-{
-	struct udev_device *parent;
+/*
+ * Entries are valid while kernel device tree generation is unchanged. If
+ * generation is not known they live for PARENT_CACHE_TTL nanoseconds.
+ */
+#define	PARENT_CACHE_TTL	1000000000ULL
+
+struct parent_cache_entry {
+	RB_ENTRY(parent_cache_entry) link;
+	struct parent_desc desc;
+	int generation;
+	uint64_t expires;
 	const char *sysname;
-	char product[80], name[80];
-	char *pnp_id = NULL;
-	size_t len;
-	uint32_t bus = BUS_VIRTUAL, prod = 0, vendor = 0;
+	char buf[];
+};
+
+static int
+parent_cache_entry_cmp(struct parent_cache_entry *pce1,
+    struct parent_cache_entry *pce2)
+{
+
+	return (strcmp(pce1->sysname, pce2->sysname));
+}
+
+RB_PROTOTYPE(parent_cache_tree, parent_cache_entry, link,
+    parent_cache_entry_cmp);
+
+/* UDEV_PARENT_CACHE=0 turns cache off, e.g. to compare timings */
+void
+parent_cache_init(struct parent_cache *pc)
+{
+	const char *env;
+
+	pthread_mutex_init(&pc->mtx, NULL);
+	RB_INIT(&pc->tree);
+	env = secure_getenv("UDEV_PARENT_CACHE");
+	pc->enabled = env == NULL || strcmp(env, "0") != 0;
+}
+
+void
+parent_cache_free(struct parent_cache *pc)
+{
+	struct parent_cache_entry *pce1, *pce2;
+
+	RB_FOREACH_SAFE(pce1, parent_cache_tree, &pc->tree, pce2) {
+		RB_REMOVE(parent_cache_tree, &pc->tree, pce1);
+		free(pce1);
+	}
+	pthread_mutex_destroy(&pc->mtx);
+}
+
+/* Drop cached description of detached driver instance */
+void
+parent_cache_forget(struct parent_cache *pc, const char *sysname, size_t len)
+{
+	char key[DEV_PATH_MAX];
+	struct parent_cache_entry find, *pce;
+
+	if (len >= sizeof(key))
+		return;
+	memcpy(key, sysname, len);
+	key[len] = '\0';
+	find.sysname = key;
+
+	pthread_mutex_lock(&pc->mtx);
+	pce = RB_FIND(parent_cache_tree, &pc->tree, &find);
+	if (pce != NULL) {
+		TRC("(%s)", pce->sysname);
+		RB_REMOVE(parent_cache_tree, &pc->tree, pce);
+		free(pce);
+	}
+	pthread_mutex_unlock(&pc->mtx);
+}
+
 #ifdef HAVE_SYSCTLBYNAME
-	char devname[DEV_PATH_MAX], mib[32], pnpinfo[1024], parentname[80];
-	const char *unit, *vendorstr, *prodstr, *devicestr;
-	size_t vendorlen, prodlen, devicelen, pnplen;
+/*
+ * Looks up description of driver instance. Stale entry is dropped. Device
+ * tree generation is returned for following insert to not race with
+ * changes made while description is read.
+ */
+static bool
+parent_cache_lookup(struct parent_cache *pc, const char *sysname,
+    struct parent_desc *desc, int *generation)
+{
+	struct parent_cache_entry find, *pce;
+	bool found = false;
+
+	if (!pc->enabled)
+		return (false);
+#ifdef HAVE_DEVINFO_H
+	*generation = scandev_generation();
+#else
+	*generation = -1;
 #endif
+	find.sysname = sysname;
+
+	pthread_mutex_lock(&pc->mtx);
+	pce = RB_FIND(parent_cache_tree, &pc->tree, &find);
+	if (pce != NULL) {
+		if (*generation >= 0 ? pce->generation == *generation :
+		    udev_stats_now() < pce->expires) {
+			*desc = pce->desc;
+			found = true;
+		} else {
+			RB_REMOVE(parent_cache_tree, &pc->tree, pce);
+			free(pce);
+		}
+	}
+	pthread_mutex_unlock(&pc->mtx);
 
-	sysname = _udev_device_get_sysname(ud);
-	len = syspathlen_wo_units(sysname);
-	/* Check if device unit number found */
-	if (strlen(sysname) == len)
+	return (found);
+}
+
+static void
+parent_cache_insert(struct parent_cache *pc, const char *sysname,
+    const struct parent_desc *desc, int generation)
+{
+	struct parent_cache_entry *pce;
+	size_t len;
+
+	if (!pc->enabled)
 		return;
 
-#ifdef HAVE_SYSCTLBYNAME
+	len = strlen(sysname) + 1;
+	pce = calloc(1, offsetof(struct parent_cache_entry, buf) + len);
+	if (pce == NULL)
+		return;
+	pce->sysname = memcpy(pce->buf, sysname, len);
+	pce->desc = *desc;
+	pce->generation = generation;
+	pce->expires = udev_stats_now() + PARENT_CACHE_TTL;
+
+	pthread_mutex_lock(&pc->mtx);
+	if (RB_INSERT(parent_cache_tree, &pc->tree, pce) != NULL)
+		free(pce);
+	pthread_mutex_unlock(&pc->mtx);
+}
+
+static int
+get_parent_desc(const char *sysname, size_t len, struct parent_desc *desc)
+{
+	char devname[DEV_PATH_MAX], mib[32], pnpinfo[1024], parentname[80];
+	const char *unit, *vendorstr, *prodstr, *devicestr, *pnp_id;
+	size_t vendorlen, prodlen, devicelen, pnplen;
+	uint32_t bus = BUS_VIRTUAL, prod = 0, vendor = 0;
+
 	snprintf(devname, len + 1, "%s", sysname);
 	unit = sysname + len;
 
 	snprintf(mib, sizeof(mib), "dev.%.17s.%.3s.%%desc", devname, unit);
-	len = sizeof(name);
-	if (sysctlbyname(mib, name, &len, NULL, 0) < 0)
-		return;
-	*(strchrnul(name, ',')) = '\0';	/* strip name */
+	len = sizeof(desc->name);
+	if (sysctlbyname(mib, desc->name, &len, NULL, 0) < 0)
+		return (-1);
+	*(strchrnul(desc->name, ',')) = '\0';	/* strip name */
 
 	snprintf(mib, sizeof(mib), "dev.%.14s.%.3s.%%pnpinfo", devname, unit);
 	len = sizeof(pnpinfo);
 	if (sysctlbyname(mib, pnpinfo, &len, NULL, 0) < 0)
-		return;
+		return (-1);
 
 	snprintf(mib, sizeof(mib), "dev.%.15s.%.3s.%%parent", devname, unit);
 	len = sizeof(parentname);
 	if (sysctlbyname(mib, parentname, &len, NULL, 0) < 0)
-		return;
+		return (-1);
 
 	vendorstr = get_kern_prop_value(pnpinfo, "vendor", &vendorlen);
 	prodstr = get_kern_prop_value(pnpinfo, "product", &prodlen);
@@ -485,8 +690,13 @@ set_parent(struct udev_device *ud)
 	pnp_id = get_kern_prop_value(pnpinfo, "_HID", &pnplen);
 	if (pnp_id != NULL && pnplen == 4 && strncmp(pnp_id, "none", 4) == 0)
 		pnp_id = NULL;
-	if (pnp_id != NULL)
-		pnp_id[pnplen] = '\0';
+	desc->pnp_id[0] = '\0';
+	if (pnp_id != NULL) {
+		if (pnplen >= sizeof(desc->pnp_id))
+			pnplen = sizeof(desc->pnp_id) - 1;
+		memcpy(desc->pnp_id, pnp_id, pnplen);
+		desc->pnp_id[pnplen] = '\0';
+	}
 	if (prodstr != NULL && vendorstr != NULL) {
 		/* XXX: should parent be compared to uhub* to detect usb? */
 		vendor = strtol(vendorstr, NULL, 0);
@@ -509,11 +719,46 @@ set_parent(struct udev_device *ud)
 		}
 		bus = BUS_I8042;
 	}
+	snprintf(desc->product, sizeof(desc->product),
+	    "%x/%x/%x/0", bus, vendor, prod);
+
+	return (0);
+}
+#endif /* HAVE_SYSCTLBYNAME */
+
+static void
+set_parent(struct udev_device *ud)
+{
+	struct udev_device *parent;
+	struct parent_desc desc;
+	const char *sysname;
+	size_t len;
+#ifdef HAVE_SYSCTLBYNAME
+	struct parent_cache *pc;
+	int generation;
+#endif
+
+	sysname = _udev_device_get_sysname(ud);
+	len = syspathlen_wo_units(sysname);
+	/* Check if device unit number found */
+	if (strlen(sysname) == len)
+		return;
+
+#ifdef HAVE_SYSCTLBYNAME
+	/* Sibling nodes of the same driver instance share description */
+	pc = udev_get_parent_cache(udev_device_get_udev(ud));
+	if (!parent_cache_lookup(pc, sysname, &desc, &generation)) {
+		if (get_parent_desc(sysname, len, &desc) != 0)
+			return;
+		parent_cache_insert(pc, sysname, &desc, generation);
+	}
 #else
-	strlcpy(name, sysname, sizeof(name));
+	strlcpy(desc.name, sysname, sizeof(desc.name));
+	snprintf(desc.product, sizeof(desc.product), "%x/0/0/0", BUS_VIRTUAL);
+	desc.pnp_id[0] = '\0';
 #endif
-	snprintf(product, sizeof(product), "%x/%x/%x/0", bus, vendor, prod);
-	parent = create_xorg_parent(ud, sysname, name, product, pnp_id);
+	parent = create_xorg_parent(ud, sysname, desc.name, desc.product,
+	    desc.pnp_id[0] != '\0' ? desc.pnp_id : NULL, NULL);
 	if (parent != NULL)
 		udev_device_set_parent(ud, parent);
 
@@ -545,7 +790,7 @@ create_kbdmux_handler(struct udev_device *ud)
 	set_input_device_type(ud, IT_KEYBOARD);
 	sysname = _udev_device_get_sysname(ud);
 	parent = create_xorg_parent(ud, sysname,
-	    "System keyboard multiplexor", "6/1/1/0", NULL);
+	    "System keyboard multiplexor", "6/1/1/0", NULL, NULL);
 	if (parent != NULL)
 		udev_device_set_parent(ud, parent);
 }
@@ -559,7 +804,7 @@ create_sysmouse_handler(struct udev_device *ud)
 	set_input_device_type(ud, IT_MOUSE);
 	sysname = _udev_device_get_sysname(ud);
 	parent = create_xorg_parent(ud, sysname,
-	    "System mouse", "6/2/1/0", NULL);
+	    "System mouse", "6/2/1/0", NULL, NULL);
 	if (parent != NULL)
 		udev_device_set_parent(ud, parent);
 }
@@ -604,8 +849,10 @@ create_drm_handler(struct udev_device *ud)
 	if (devpath == NULL)
 		return;
 
+	/* Parent is amended below so it can not be shared */
 	sysname = _udev_device_get_sysname(ud);
-	parent = create_xorg_parent(ud, sysname, "drm parent", NULL, NULL);
+	parent = new_xorg_parent(udev_device_get_udev(ud), sysname,
+	    "drm parent", NULL, NULL, NULL);
 	if (parent == NULL)
 		return;
 
@@ -645,13 +892,10 @@ create_drm_handler(struct udev_device *ud)
 void
 create_hidraw_handler(struct udev_device *ud)
 {
-	char name[80], phys[80], uniq[32];
+	char name[80], phys[80], uniq[32], product[80], uevent[256];
 	const char *sysname;
-	char *uevent;
 	struct hidraw_devinfo info;
 	struct udev_device *parent;
-	struct udev *udev;
-	struct udev_list *sysattrs;
 	int fd = -1;
 	bool opened = false;
 
@@ -671,22 +915,34 @@ create_hidraw_handler(struct udev_device *ud)
 		goto bail_out;
 	}
 
-	sysname = phys[0] == 0 ? virtual_sysname : phys;
-	udev = udev_device_get_udev(ud);
-	parent = udev_device_new_common(udev, sysname, UD_ACTION_NONE);
-	if (parent == NULL)
-		goto bail_out;
+	if (info.bustype == BUS_USB)
+		udev_device_add_modalias(ud, "usb:v%04Xp%04X",
+		    (uint16_t)info.vendor, (uint16_t)info.product);
 
-	udev_device_set_parent(ud, parent);
-	sysattrs = udev_device_get_sysattr_list(parent);
-	asprintf(&uevent,
+	sysname = phys[0] == 0 ? virtual_sysname : phys;
+	snprintf(uevent, sizeof(uevent),
 	    "HID_ID=%04X:%08X:%08X\nHID_NAME=%s\nHID_PHYS=%s\nHID_UNIQ=%s",
-	    info.bustype, info.vendor, info.product, name, phys, uniq);
-	udev_list_insert(sysattrs, "uevent", uevent);
-	free(uevent);
+	    info.bustype, (uint16_t)info.vendor, (uint16_t)info.product,
+	    name, phys, uniq);
+	/* hidraw does not report version, evdev node may know better */
+	snprintf(product, sizeof(product), "%x/%x/%x/0",
+	    info.bustype, (uint16_t)info.vendor, (uint16_t)info.product);
+
+	/* Virtual devices have no location to tell them apart */
+	if (sysname == virtual_sysname)
+		parent = new_xorg_parent(udev_device_get_udev(ud), sysname,
+		    name, product, NULL, uevent);
+	else
+		parent = create_xorg_parent(ud, sysname, name, product, NULL,
+		    uevent);
+	if (parent != NULL)
+		udev_device_set_parent(ud, parent);
 
 bail_out:
 	if (opened)
 		close(fd);
 }
 #endif
+
+RB_GENERATE(parent_cache_tree, parent_cache_entry, link,
+    parent_cache_entry_cmp);
@@ -28,10 +28,26 @@
 
 #include "config.h"
 
+#include <pthread.h>
+
 #include "udev-utils.h"
 
 struct udev_enumerate;
 
+/* Parsed description of driver instance xorg parent device is built from */
+struct parent_desc {
+	char name[80];
+	char product[80];
+	char pnp_id[32];
+};
+
+RB_HEAD(parent_cache_tree, parent_cache_entry);
+struct parent_cache {
+	pthread_mutex_t mtx;
+	struct parent_cache_tree tree;
+	bool enabled;
+};
+
 #if defined (HAVE_LINUX_INPUT_H) || defined (HAVE_DEV_EVDEV_INPUT_H)
 create_node_handler_t	create_evdev_handler;
 #endif
@@ -49,5 +65,9 @@ create_node_handler_t	create_hidraw_handler;
 
 int udev_dev_enumerate(struct udev_enumerate *ue);
 int udev_dev_monitor(char *msg, char *syspath, size_t syspathlen);
+void parent_cache_init(struct parent_cache *pc);
+void parent_cache_free(struct parent_cache *pc);
+void parent_cache_forget(struct parent_cache *pc, const char *sysname,
+    size_t len);
 
 #endif /* UDEV_DEV_H_ */
@@ -23,12 +23,17 @@
  * SUCH DAMAGE.
  */
 
+#include "config.h"
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #ifdef __linux__
 #include <sys/sysmacros.h>
 #endif
 
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -44,15 +49,58 @@ struct udev_device {
 		unsigned int action : 2;
 		unsigned int parent_ref : 1;
 	} flags;
+	/* Set once by getters which may race, so not in flags word */
+	bool hwdb_imported;
+	bool devnum_cached;
+	dev_t devnum;
 	struct udev_list prop_list;
 	struct udev_list sysattr_list;
 	struct udev_list tag_list;
 	struct udev_list devlink_list;
+	struct udev_list modalias_list;
 	struct udev *udev;
 	struct udev_device *parent;
+	struct udev_device_cache_entry *cache_entry;
+	char *devnode;		/* node in relocated device tree */
 	char syspath[];
 };
 
+struct udev_device_cache_entry {
+	RB_ENTRY(udev_device_cache_entry) link;
+	struct udev_device *ud;
+	const char *key;
+	char buf[];
+};
+
+static int
+udev_device_cache_entry_cmp(struct udev_device_cache_entry *udce1,
+    struct udev_device_cache_entry *udce2)
+{
+
+	return (strcmp(udce1->key, udce2->key));
+}
+
+RB_PROTOTYPE(udev_device_cache_tree, udev_device_cache_entry, link,
+    udev_device_cache_entry_cmp);
+
+struct udev_hwdb_cache_entry {
+	RB_ENTRY(udev_hwdb_cache_entry) link;
+	struct udev_list props;
+	const char *modalias;
+	char buf[];
+};
+
+static int
+udev_hwdb_cache_entry_cmp(struct udev_hwdb_cache_entry *uhce1,
+    struct udev_hwdb_cache_entry *uhce2)
+{
+
+	return (strcmp(uhce1->modalias, uhce2->modalias));
+}
+
+RB_PROTOTYPE(udev_hwdb_cache_tree, udev_hwdb_cache_entry, link,
+    udev_hwdb_cache_entry_cmp);
+
 LIBUDEV_EXPORT struct udev_device *
 udev_device_new_from_syspath(struct udev *udev, const char *syspath)
 {
@@ -67,13 +115,18 @@ udev_device_new_from_devnum(struct udev *udev, char type, dev_t devnum)
 	const char *syspath;
 	struct udev_device *device;
 
-	syspath = get_syspath_by_devnum(devnum);
+	syspath = get_syspath_by_devnum(udev, devnum);
 	TRC("(%d) -> %s", (int)devnum, syspath != NULL ? syspath : "not found");
 	if (syspath == NULL)
 		return (NULL);
 
 	device = udev_device_new_common(udev, syspath, UD_ACTION_NONE);
 	free((void *)syspath);
+	/* Node was just matched against devnum, no need to stat it again */
+	if (device != NULL) {
+		device->devnum = devnum;
+		device->devnum_cached = true;
+	}
 
 	return (device);
 }
@@ -82,10 +135,15 @@ LIBUDEV_EXPORT struct udev_device *
 udev_device_new_from_subsystem_sysname(struct udev *udev,
    const char *subsystem, const char *sysname)
 {
+	char syspath[DEV_PATH_MAX];
 
 	TRC("(%s, %s)", subsystem, sysname);
-	UNIMPL();
-	return (NULL);
+	if (subsystem == NULL || sysname == NULL ||
+	    !get_syspath_by_subsystem_sysname(udev, subsystem, sysname,
+	    syspath, sizeof(syspath)))
+		return (NULL);
+
+	return (udev_device_new_common(udev, syspath, UD_ACTION_NONE));
 }
 
 LIBUDEV_EXPORT struct udev_device *
@@ -104,14 +162,21 @@ udev_device_new_from_environment(struct udev *udev)
 	return (NULL);
 }
 
+static const char *
+_udev_device_get_devnode(struct udev_device *ud)
+{
+
+	if (ud->devnode != NULL)
+		return (ud->devnode);
+	return (get_devpath_by_syspath(ud->syspath));
+}
+
 LIBUDEV_EXPORT char const *
 udev_device_get_devnode(struct udev_device *ud)
 {
-	const char *devpath;
 
 	TRC("(%p) %s", ud, ud->syspath);
-	devpath = get_devpath_by_syspath(ud->syspath);
-	return (devpath);
+	return (_udev_device_get_devnode(ud));
 }
 
 LIBUDEV_EXPORT char const *
@@ -134,6 +199,7 @@ udev_device_get_properties_list_entry(struct udev_device *ud)
 {
 
 	TRC("(%p(%s))", ud, ud->syspath);
+	udev_device_import_hwdb(ud);
 	return (udev_list_entry_get_first(udev_device_get_properties_list(ud)));
 }
 
@@ -199,6 +265,7 @@ udev_device_get_property_value(struct udev_device *ud, char const *property)
 	char const *key, *value;
 	struct udev_list_entry *entry;
 
+	udev_device_import_hwdb(ud);
 	udev_list_entry_foreach(entry, udev_list_entry_get_first(&ud->prop_list)) {
 		key = _udev_list_entry_get_name(entry);
 		if (!key)
@@ -271,12 +338,22 @@ udev_device_new_common(struct udev *udev, const char *syspath, int action)
 	ud->udev = udev;
 	ud->flags.action = action;
 	ud->parent = NULL;
+	ud->cache_entry = NULL;
 	ud->refcount = 1;
 	strcpy(ud->syspath, syspath);
+	if (udev_get_dev_root(udev)[0] != '\0' &&
+	    syspath_is_devpath(syspath) &&
+	    asprintf(&ud->devnode, "%s%s", udev_get_dev_root(udev),
+	    syspath) < 0) {
+		_udev_unref(udev);
+		free(ud);
+		return (NULL);
+	}
 	udev_list_init(&ud->prop_list);
 	udev_list_init(&ud->sysattr_list);
 	udev_list_init(&ud->tag_list);
 	udev_list_init(&ud->devlink_list);
+	udev_list_init(&ud->modalias_list);
 	if (action != UD_ACTION_REMOVE)
 		invoke_create_handler(ud);
 
@@ -325,9 +402,18 @@ udev_device_get_subsystem(struct udev_device *ud)
 LIBUDEV_EXPORT struct udev_device *
 udev_device_ref(struct udev_device *ud)
 {
+	struct udev_device_cache *udc;
+
 	TRC("(%p/%s) %d", ud, ud->syspath, ud->refcount);
 
-	++ud->refcount;
+	/* Shared devices can be referenced from other threads */
+	if (ud->cache_entry != NULL) {
+		udc = udev_get_device_cache(ud->udev);
+		pthread_mutex_lock(&udc->mtx);
+		++ud->refcount;
+		pthread_mutex_unlock(&udc->mtx);
+	} else
+		++ud->refcount;
 	return (ud);
 }
 
@@ -339,17 +425,36 @@ udev_device_free(struct udev_device *ud)
 	udev_list_free(&ud->sysattr_list);
 	udev_list_free(&ud->tag_list);
 	udev_list_free(&ud->devlink_list);
+	udev_list_free(&ud->modalias_list);
 	if (!ud->flags.parent_ref && ud->parent != NULL)
-		udev_device_free(ud->parent);
+		udev_device_unref(ud->parent);
 	_udev_unref(ud->udev);
+	free(ud->devnode);
 	free(ud);
 }
 
 LIBUDEV_EXPORT struct udev_device *
 udev_device_unref(struct udev_device *ud)
 {
+	struct udev_device_cache *udc;
+	int refcount;
+
 	TRC("(%p/%s) %d", ud, ud->syspath, ud->refcount);
-	if (--ud->refcount == 0)
+	if (ud->cache_entry != NULL) {
+		udc = udev_get_device_cache(ud->udev);
+		pthread_mutex_lock(&udc->mtx);
+		refcount = --ud->refcount;
+		if (refcount == 0) {
+			RB_REMOVE(udev_device_cache_tree, &udc->tree,
+			    ud->cache_entry);
+			free(ud->cache_entry);
+			ud->cache_entry = NULL;
+		}
+		pthread_mutex_unlock(&udc->mtx);
+	} else
+		refcount = --ud->refcount;
+
+	if (refcount == 0)
 		udev_device_free(ud);
 	return (NULL);
 }
@@ -401,6 +506,193 @@ udev_device_set_parent(struct udev_device *ud, struct udev_device *parent)
 	ud->parent = parent;
 }
 
+/* Registers modalias to look up in hwdb on first property access */
+int
+udev_device_add_modalias(struct udev_device *ud, const char *fmt, ...)
+{
+	char *modalias = NULL;
+	va_list ap;
+	int ret = -1;
+
+	va_start(ap, fmt);
+	vasprintf(&modalias, fmt, ap);
+	va_end(ap);
+
+	if (modalias != NULL) {
+		ret = udev_list_insert(&ud->modalias_list, modalias, NULL);
+		free(modalias);
+	}
+
+	return (ret);
+}
+
+static struct udev_hwdb_cache_entry *
+udev_hwdb_cache_get(struct udev *udev, struct udev_hwdb_cache *uhc,
+    const char *modalias)
+{
+	struct udev_hwdb_cache_entry find, *uhce;
+	struct udev_list_entry *ule;
+
+	find.modalias = modalias;
+	uhce = RB_FIND(udev_hwdb_cache_tree, &uhc->tree, &find);
+	if (uhce != NULL)
+		return (uhce);
+
+	if (uhc->hwdb == NULL)
+		uhc->hwdb = udev_hwdb_new(udev);
+	if (uhc->hwdb == NULL)
+		return (NULL);
+
+	uhce = calloc(1, offsetof(struct udev_hwdb_cache_entry, buf) +
+	    strlen(modalias) + 1);
+	if (uhce == NULL)
+		return (NULL);
+	uhce->modalias = strcpy(uhce->buf, modalias);
+
+	/* Misses are memoized too */
+	udev_list_init(&uhce->props);
+	udev_list_entry_foreach(ule,
+	    udev_hwdb_get_properties_list_entry(uhc->hwdb, modalias, 0))
+		udev_list_insert(&uhce->props, _udev_list_entry_get_name(ule),
+		    _udev_list_entry_get_value(ule));
+	RB_INSERT(udev_hwdb_cache_tree, &uhc->tree, uhce);
+
+	return (uhce);
+}
+
+void
+udev_device_import_hwdb(struct udev_device *ud)
+{
+	struct udev_hwdb_cache *uhc;
+	struct udev_hwdb_cache_entry *uhce;
+	struct udev_list_entry *mle, *ule;
+
+	/* Shared parents are read by several threads */
+	if (__atomic_load_n(&ud->hwdb_imported, __ATOMIC_ACQUIRE))
+		return;
+
+	uhc = udev_get_hwdb_cache(ud->udev);
+	pthread_mutex_lock(&uhc->mtx);
+	if (ud->hwdb_imported) {
+		pthread_mutex_unlock(&uhc->mtx);
+		return;
+	}
+	mle = udev_list_entry_get_first(&ud->modalias_list);
+	udev_list_entry_foreach(mle, mle) {
+		uhce = udev_hwdb_cache_get(ud->udev, uhc,
+		    _udev_list_entry_get_name(mle));
+		if (uhce == NULL)
+			continue;
+		udev_list_entry_foreach(ule,
+		    udev_list_entry_get_first(&uhce->props))
+			udev_list_insert(&ud->prop_list,
+			    _udev_list_entry_get_name(ule),
+			    _udev_list_entry_get_value(ule));
+	}
+	__atomic_store_n(&ud->hwdb_imported, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&uhc->mtx);
+}
+
+void
+udev_hwdb_cache_init(struct udev_hwdb_cache *uhc)
+{
+
+	pthread_mutex_init(&uhc->mtx, NULL);
+	uhc->hwdb = NULL;
+	RB_INIT(&uhc->tree);
+}
+
+void
+udev_hwdb_cache_free(struct udev_hwdb_cache *uhc)
+{
+	struct udev_hwdb_cache_entry *uhce1, *uhce2;
+
+	RB_FOREACH_SAFE(uhce1, udev_hwdb_cache_tree, &uhc->tree, uhce2) {
+		RB_REMOVE(udev_hwdb_cache_tree, &uhc->tree, uhce1);
+		udev_list_free(&uhce1->props);
+		free(uhce1);
+	}
+	udev_hwdb_unref(uhc->hwdb);
+	pthread_mutex_destroy(&uhc->mtx);
+}
+
+void
+udev_device_cache_init(struct udev_device_cache *udc)
+{
+
+	pthread_mutex_init(&udc->mtx, NULL);
+	RB_INIT(&udc->tree);
+}
+
+void
+udev_device_cache_free(struct udev_device_cache *udc)
+{
+
+	/* Entries are owned by devices which keep udev context alive */
+	assert(RB_EMPTY(&udc->tree));
+	pthread_mutex_destroy(&udc->mtx);
+}
+
+/* Returns referenced shared device stored under the key or NULL */
+struct udev_device *
+udev_device_cache_get(struct udev *udev, const char *key)
+{
+	struct udev_device_cache *udc;
+	struct udev_device_cache_entry find, *udce;
+	struct udev_device *ud = NULL;
+
+	find.key = key;
+	udc = udev_get_device_cache(udev);
+	pthread_mutex_lock(&udc->mtx);
+	udce = RB_FIND(udev_device_cache_tree, &udc->tree, &find);
+	if (udce != NULL) {
+		ud = udce->ud;
+		++ud->refcount;
+	}
+	pthread_mutex_unlock(&udc->mtx);
+
+	return (ud);
+}
+
+/*
+ * Shares fully constructed device under the key. If other thread managed
+ * to share device with the same key first, the passed one is released
+ * and referenced winner is returned instead.
+ */
+struct udev_device *
+udev_device_cache_add(struct udev *udev, const char *key,
+    struct udev_device *ud)
+{
+	struct udev_device_cache *udc;
+	struct udev_device_cache_entry *udce, *old_udce;
+	struct udev_device *old_ud = NULL;
+
+	udce = calloc(1,
+	    offsetof(struct udev_device_cache_entry, buf) + strlen(key) + 1);
+	if (udce == NULL)
+		return (ud);
+	udce->key = strcpy(udce->buf, key);
+	udce->ud = ud;
+
+	udc = udev_get_device_cache(udev);
+	pthread_mutex_lock(&udc->mtx);
+	old_udce = RB_INSERT(udev_device_cache_tree, &udc->tree, udce);
+	if (old_udce != NULL) {
+		old_ud = old_udce->ud;
+		++old_ud->refcount;
+	} else
+		ud->cache_entry = udce;
+	pthread_mutex_unlock(&udc->mtx);
+
+	if (old_ud != NULL) {
+		free(udce);
+		udev_device_unref(ud);
+		return (old_ud);
+	}
+
+	return (ud);
+}
+
 LIBUDEV_EXPORT int
 udev_device_get_is_initialized(struct udev_device *ud)
 {
@@ -434,20 +726,60 @@ udev_device_get_action(struct udev_device *ud)
 	return (action);
 }
 
-LIBUDEV_EXPORT dev_t
-udev_device_get_devnum(struct udev_device *ud)
+/*
+ * Stats device node once per udev_device lifetime. Failed stat is not
+ * cached as node may not be created yet when device is announced.
+ */
+static dev_t
+udev_device_load_devnum(struct udev_device *ud)
 {
 	const char *devpath;
 	struct stat st;
+	dev_t devnum;
+
+	if (__atomic_load_n(&ud->devnum_cached, __ATOMIC_ACQUIRE))
+		return (__atomic_load_n(&ud->devnum, __ATOMIC_RELAXED));
+
+	devpath = _udev_device_get_devnode(ud);
+	if (devpath == NULL) {
+		devnum = makedev(0, 0);
+	} else {
+		STATS_INC(backend_syscalls);
+		if (stat(devpath, &st) < 0 || !S_ISCHR(st.st_mode))
+			return (makedev(0, 0));
+		devnum = st.ST_RDEV;
+	}
+	/* Racing getters store the same value */
+	__atomic_store_n(&ud->devnum, devnum, __ATOMIC_RELAXED);
+	__atomic_store_n(&ud->devnum_cached, true, __ATOMIC_RELEASE);
+
+	return (devnum);
+}
+
+LIBUDEV_EXPORT dev_t
+udev_device_get_devnum(struct udev_device *ud)
+{
 
 	TRC("(%p) %s", ud, ud->syspath);
-	devpath = get_devpath_by_syspath(ud->syspath);
-	if (devpath == NULL ||
-	    stat(devpath, &st) < 0 ||
-	    !S_ISCHR(st.st_mode))
-		return (makedev(0, 0));
+	return (udev_device_load_devnum(ud));
+}
+
+LIBUDEV_EXPORT int
+udev_device_get_devnode_devnum(struct udev_device *ud, const char **devnode,
+    dev_t *devnum)
+{
+	dev_t num;
 
-	return (st.ST_RDEV);
+	TRC("(%p) %s", ud, ud->syspath);
+	num = udev_device_load_devnum(ud);
+	if (num == makedev(0, 0))
+		return (-ENODEV);
+
+	if (devnode != NULL)
+		*devnode = _udev_device_get_devnode(ud);
+	if (devnum != NULL)
+		*devnum = num;
+	return (0);
 }
 
 LIBUDEV_EXPORT const char *
@@ -494,3 +826,8 @@ udev_device_get_usec_since_initialized(struct udev_device *ud)
 	UNIMPL();
 	return (0);
 }
+
+RB_GENERATE(udev_device_cache_tree, udev_device_cache_entry, link,
+    udev_device_cache_entry_cmp);
+RB_GENERATE(udev_hwdb_cache_tree, udev_hwdb_cache_entry, link,
+    udev_hwdb_cache_entry_cmp);
@@ -26,6 +26,8 @@
 #ifndef UDEV_DEVICE_H_
 #define UDEV_DEVICE_H_
 
+#include <pthread.h>
+
 #include "libudev.h"
 #include "udev-list.h"
 
@@ -37,14 +39,38 @@ enum {
 	UD_ACTION_HOTPLUG,
 };
 
+/* Table of parent devices shared between children */
+RB_HEAD(udev_device_cache_tree, udev_device_cache_entry);
+struct udev_device_cache {
+	pthread_mutex_t mtx;
+	struct udev_device_cache_tree tree;
+};
+
+/* Properties found in hwdb, memoized by modalias */
+RB_HEAD(udev_hwdb_cache_tree, udev_hwdb_cache_entry);
+struct udev_hwdb_cache {
+	pthread_mutex_t mtx;
+	struct udev_hwdb *hwdb;
+	struct udev_hwdb_cache_tree tree;
+};
+
 struct udev_device *udev_device_new_common(struct udev *udev,
     const char *syspath, int action);
 struct udev_list *udev_device_get_properties_list(struct udev_device *ud);
 struct udev_list *udev_device_get_sysattr_list(struct udev_device *ud);
 struct udev_list *udev_device_get_tags_list(struct udev_device *ud);
 struct udev_list *udev_device_get_devlinks_list(struct udev_device *ud);
+int udev_device_add_modalias(struct udev_device *ud, const char *fmt, ...);
+void udev_device_import_hwdb(struct udev_device *ud);
 void udev_device_set_parent(struct udev_device *ud, struct udev_device *parent);
 const char *_udev_device_get_syspath(struct udev_device *ud);
 const char *_udev_device_get_sysname(struct udev_device *ud);
+void udev_device_cache_init(struct udev_device_cache *udc);
+void udev_device_cache_free(struct udev_device_cache *udc);
+struct udev_device *udev_device_cache_get(struct udev *udev, const char *key);
+struct udev_device *udev_device_cache_add(struct udev *udev, const char *key,
+    struct udev_device *ud);
+void udev_hwdb_cache_init(struct udev_hwdb_cache *uhc);
+void udev_hwdb_cache_free(struct udev_hwdb_cache *uhc);
 
 #endif /* UDEV_DVICE_H_ */
@@ -23,10 +23,13 @@
  * SUCH DAMAGE.
  */
 
+#include "config.h"
+
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,13 +37,28 @@
 
 #include "udev-global.h"
 
+struct enumerate_profile;
+
 struct udev_enumerate {
 	int refcount;
 	struct udev_filter_head filters;
 	struct udev_list dev_list;
 	struct udev *udev;
+	struct enumerate_profile *profile;	/* NULL if not profiled */
+	STAILQ_ENTRY(udev_enumerate) profile_link;
+	bool scanning;		/* dev_list is rebuilt, protected by mutex */
+	unsigned long long visited;
+	unsigned long long matched;
 };
 
+/* Profiled enumerators, charged for devices created from their lists */
+static STAILQ_HEAD(, udev_enumerate) profile_list =
+    STAILQ_HEAD_INITIALIZER(profile_list);
+static pthread_mutex_t profile_mtx = PTHREAD_MUTEX_INITIALIZER;
+int udev_enumerate_profiled = 0;
+
+static void udev_enumerate_profile_report(struct udev_enumerate *ue);
+
 LIBUDEV_EXPORT struct udev_enumerate *
 udev_enumerate_new(struct udev *udev)
 {
@@ -56,6 +74,8 @@ udev_enumerate_new(struct udev *udev)
 	ue->refcount = 1;
 	udev_filter_init(&ue->filters);
 	udev_list_init(&ue->dev_list);
+	if (secure_getenv("UDEV_ENUMERATE_PROFILE") != NULL)
+		udev_enumerate_set_profile(ue, 1);
 
 	return (ue);
 }
@@ -75,6 +95,10 @@ udev_enumerate_unref(struct udev_enumerate *ue)
 
 	TRC("(%p) refcount=%d", ue, ue->refcount);
 	if (--ue->refcount == 0) {
+		if (ue->profile != NULL) {
+			udev_enumerate_profile_report(ue);
+			udev_enumerate_set_profile(ue, 0);
+		}
 		udev_filter_free(&ue->filters);
 		udev_list_free(&ue->dev_list);
 		udev_unref(ue->udev);
@@ -172,30 +196,314 @@ udev_enumerate_add_match_is_initialized(struct udev_enumerate *ue)
 int
 udev_enumerate_add_device(struct udev_enumerate *ue, const char *syspath)
 {
-	if (udev_filter_match(ue->udev, &ue->filters, syspath) &&
-	    udev_list_insert(&ue->dev_list, syspath, NULL) == -1)
+
+	STATS_INC(enumerate_nodes);
+	ue->visited++;
+	if (!udev_filter_match(ue->udev, &ue->filters, syspath))
+		return (0);
+	ue->matched++;
+	if (udev_list_insert(&ue->dev_list, syspath, NULL) == -1)
 		return (-1);
 	return (0);
 }
 
+static int udev_enumerate_scan_devinfo(struct udev_enumerate *ue);
+
+static const struct {
+	const char *name;
+	int (*enumerate)(struct udev_enumerate *ue);
+} enumerate_backends[] = {
+	{ "dev", udev_dev_enumerate },
+	/* PCI table is refreshed before devinfo walk creates pci devices */
+	{ "pcitable", udev_pci_enumerate },
+	{ "devinfo", udev_enumerate_scan_devinfo },
+	{ "net", udev_net_enumerate },
+};
+
+#ifdef HAVE_DEVINFO_H
+/* Callbacks of devinfo walk, profiled as parts of its row */
+static const struct {
+	const char *name;
+	scandev_cb_t cb;
+} devinfo_callbacks[] = {
+	{ "sys", udev_sys_enumerate_cb },
+	{ "pci", udev_pci_enumerate_cb },
+};
+#endif
+
+/*
+ * Cost of scans accumulated over enumerator lifetime. Syscall and handler
+ * figures are deltas of process-wide counters, so other threads working
+ * with libudev at the same time inflate them.
+ */
+struct enumerate_profile_row {
+	uint64_t ns;
+	unsigned long long syscalls;
+	unsigned long long visited;
+	unsigned long long matched;
+};
+
+struct enumerate_profile {
+	unsigned long long scans;
+	struct enumerate_profile_row backends[nitems(enumerate_backends)];
+#ifdef HAVE_DEVINFO_H
+	struct enumerate_profile_row callbacks[nitems(devinfo_callbacks)];
+#endif
+	unsigned long long handler_calls[UDEV_STATS_SUBSYSTEM_CNT];
+	uint64_t handler_ns[UDEV_STATS_SUBSYSTEM_CNT];
+	/* Devices created later by consumer from enumerated syspaths */
+	unsigned long long device_calls[UDEV_STATS_SUBSYSTEM_CNT];
+	uint64_t device_ns[UDEV_STATS_SUBSYSTEM_CNT];
+};
+
+struct enumerate_sample {
+	uint64_t ns;
+	unsigned long long visited;
+	unsigned long long matched;
+	struct udev_stats stats;
+};
+
+static void
+udev_enumerate_sample(struct udev_enumerate *ue, struct enumerate_sample *es)
+{
+
+	udev_get_stats(&es->stats, sizeof(es->stats));
+	es->visited = ue->visited;
+	es->matched = ue->matched;
+	es->ns = udev_stats_now();
+}
+
+/* Charges work done since start sample to profile row */
+static void
+udev_enumerate_profile_account(struct udev_enumerate *ue,
+    struct enumerate_profile_row *row, const struct enumerate_sample *start,
+    struct enumerate_sample *end)
+{
+
+	udev_enumerate_sample(ue, end);
+	row->ns += end->ns - start->ns;
+	row->syscalls +=
+	    end->stats.backend_syscalls - start->stats.backend_syscalls;
+	row->visited += end->visited - start->visited;
+	row->matched += end->matched - start->matched;
+}
+
+/* Charges backend, and handlers it ran, for work since start sample */
+static void
+udev_enumerate_profile_backend(struct udev_enumerate *ue, size_t backend,
+    const struct enumerate_sample *start)
+{
+	struct enumerate_profile *ep = ue->profile;
+	struct enumerate_sample end;
+	int i;
+
+	udev_enumerate_profile_account(ue, &ep->backends[backend], start,
+	    &end);
+	for (i = 0; i < UDEV_STATS_SUBSYSTEM_CNT; i++) {
+		ep->handler_calls[i] += end.stats.handler_calls[i] -
+		    start->stats.handler_calls[i];
+		ep->handler_ns[i] += end.stats.handler_ns[i] -
+		    start->stats.handler_ns[i];
+	}
+}
+
+#ifdef HAVE_DEVINFO_H
+struct devinfo_profile_args {
+	struct udev_enumerate *ue;
+	size_t idx;
+};
+
+static int
+udev_enumerate_profile_cb(struct devinfo_dev *dev, void *args)
+{
+	struct devinfo_profile_args *dpa = args;
+	struct enumerate_sample start, end;
+	int ret;
+
+	udev_enumerate_sample(dpa->ue, &start);
+	ret = devinfo_callbacks[dpa->idx].cb(dev, dpa->ue);
+	udev_enumerate_profile_account(dpa->ue,
+	    &dpa->ue->profile->callbacks[dpa->idx], &start, &end);
+
+	return (ret);
+}
+#endif
+
+/* Runs sys and pci callbacks over single devinfo snapshot */
+static int
+udev_enumerate_scan_devinfo(struct udev_enumerate *ue)
+{
+#ifdef HAVE_DEVINFO_H
+	struct scandev_ctx ctx[nitems(devinfo_callbacks)];
+	struct devinfo_profile_args args[nitems(devinfo_callbacks)];
+	size_t i;
+
+	for (i = 0; i < nitems(devinfo_callbacks); i++) {
+		if (ue->profile != NULL) {
+			args[i].ue = ue;
+			args[i].idx = i;
+			ctx[i].cb = udev_enumerate_profile_cb;
+			ctx[i].args = &args[i];
+		} else {
+			ctx[i].cb = devinfo_callbacks[i].cb;
+			ctx[i].args = ue;
+		}
+	}
+
+	return (scandev_recursive(ctx, nitems(ctx)));
+#else
+	return (0);
+#endif
+}
+
+/* Charges handler of device created outside of scan to its enumerators */
+void
+udev_enumerate_profile_handler(struct udev_device *ud, int idx, uint64_t ns)
+{
+	struct udev_enumerate *ue;
+	struct udev_list_entry *first;
+	const char *syspath;
+
+	syspath = udev_device_get_syspath(ud);
+	pthread_mutex_lock(&profile_mtx);
+	STAILQ_FOREACH(ue, &profile_list, profile_link) {
+		if (ue->scanning || ue->udev != udev_device_get_udev(ud))
+			continue;
+		first = udev_list_entry_get_first(&ue->dev_list);
+		if (udev_list_entry_get_by_name(first, syspath) == NULL)
+			continue;
+		ue->profile->device_calls[idx]++;
+		ue->profile->device_ns[idx] += ns;
+	}
+	pthread_mutex_unlock(&profile_mtx);
+}
+
+static void
+udev_enumerate_profile_report_handlers(const char *title,
+    const unsigned long long *calls, const uint64_t *ns)
+{
+	int i;
+
+	fprintf(stderr, "  %-10s %12s %10s\n", title, "time_us", "calls");
+	for (i = 0; i < UDEV_STATS_SUBSYSTEM_CNT; i++)
+		if (calls[i] != 0)
+			fprintf(stderr, "  %-10s %12.1f %10llu\n",
+			    udev_stats_subsystem_name(i), ns[i] / 1000.0,
+			    calls[i]);
+}
+
+static void
+udev_enumerate_profile_report_row(const char *name,
+    const struct enumerate_profile_row *row)
+{
+
+	fprintf(stderr, "  %-10s %12.1f %10llu %10llu %10llu\n", name,
+	    row->ns / 1000.0, row->syscalls, row->visited, row->matched);
+}
+
+/*
+ * Profile is a report asked for explicitly, so it goes to stderr whatever
+ * log priority is. Rows of devinfo callbacks are parts of devinfo row.
+ */
+static void
+udev_enumerate_profile_report(struct udev_enumerate *ue)
+{
+	struct enumerate_profile *ep = ue->profile;
+#ifdef HAVE_DEVINFO_H
+	char name[16];
+	size_t j;
+#endif
+	size_t i;
+
+	fprintf(stderr, "udev_enumerate %p: %llu scans\n", ue, ep->scans);
+	if (ep->scans == 0)
+		return;
+
+	fprintf(stderr, "  %-10s %12s %10s %10s %10s\n",
+	    "backend", "time_us", "syscalls", "visited", "matched");
+	for (i = 0; i < nitems(enumerate_backends); i++) {
+		udev_enumerate_profile_report_row(enumerate_backends[i].name,
+		    &ep->backends[i]);
+#ifdef HAVE_DEVINFO_H
+		if (enumerate_backends[i].enumerate !=
+		    udev_enumerate_scan_devinfo)
+			continue;
+		for (j = 0; j < nitems(devinfo_callbacks); j++) {
+			snprintf(name, sizeof(name), "  %s",
+			    devinfo_callbacks[j].name);
+			udev_enumerate_profile_report_row(name,
+			    &ep->callbacks[j]);
+		}
+#endif
+	}
+
+	udev_enumerate_profile_report_handlers("handler", ep->handler_calls,
+	    ep->handler_ns);
+	udev_enumerate_profile_report_handlers("device", ep->device_calls,
+	    ep->device_ns);
+}
+
+/* Turns on per backend profile printed to stderr on last unref */
+LIBUDEV_EXPORT int
+udev_enumerate_set_profile(struct udev_enumerate *ue, int enable)
+{
+
+	TRC("(%p, %d)", ue, enable);
+	pthread_mutex_lock(&profile_mtx);
+	if (!enable && ue->profile != NULL) {
+		STAILQ_REMOVE(&profile_list, ue, udev_enumerate, profile_link);
+		udev_enumerate_profiled--;
+		free(ue->profile);
+		ue->profile = NULL;
+	} else if (enable && ue->profile == NULL) {
+		ue->profile = calloc(1, sizeof(struct enumerate_profile));
+		if (ue->profile != NULL) {
+			STAILQ_INSERT_TAIL(&profile_list, ue, profile_link);
+			udev_enumerate_profiled++;
+		}
+	}
+	pthread_mutex_unlock(&profile_mtx);
+	return (enable && ue->profile == NULL ? -1 : 0);
+}
+
+static void
+udev_enumerate_set_scanning(struct udev_enumerate *ue, bool scanning)
+{
+
+	pthread_mutex_lock(&profile_mtx);
+	ue->scanning = scanning;
+	pthread_mutex_unlock(&profile_mtx);
+}
+
 LIBUDEV_EXPORT int
 udev_enumerate_scan_devices(struct udev_enumerate *ue)
 {
-	int ret;
+	struct enumerate_sample start;
+	size_t i;
+	int ret = 0;
 
 	TRC("(%p)", ue);
+	STATS_INC(enumerate_scans);
 
+	if (ue->profile != NULL) {
+		udev_enumerate_set_scanning(ue, true);
+		ue->profile->scans++;
+	}
 	udev_list_free(&ue->dev_list);
 
-	ret = udev_dev_enumerate(ue);
-	if (ret == 0)
-		ret = udev_sys_enumerate(ue);
-	if (ret == 0)
-		ret = udev_pci_enumerate(ue);
-	if (ret == 0)
-		ret = udev_net_enumerate(ue);
+	for (i = 0; i < nitems(enumerate_backends) && ret == 0; i++) {
+		PROBE1(enumerate__start, enumerate_backends[i].name);
+		if (ue->profile != NULL)
+			udev_enumerate_sample(ue, &start);
+		ret = enumerate_backends[i].enumerate(ue);
+		if (ue->profile != NULL)
+			udev_enumerate_profile_backend(ue, i, &start);
+		PROBE2(enumerate__end, enumerate_backends[i].name, ret);
+	}
 	if (ret == -1)
 		udev_list_free(&ue->dev_list);
+	if (ue->profile != NULL)
+		udev_enumerate_set_scanning(ue, false);
 	return ret;
 }
 
@@ -26,8 +26,16 @@
 #ifndef UDEV_ENUMERATE_H_
 #define UDEV_ENUMERATE_H_
 
+#include <stdint.h>
+
+struct udev_device;
 struct udev_enumerate;
 
+/* Number of profiled enumerators, checked unlocked by device creation */
+extern int udev_enumerate_profiled;
+
 int udev_enumerate_add_device(struct udev_enumerate *ue, const char *syspath);
+void udev_enumerate_profile_handler(struct udev_device *ud, int idx,
+    uint64_t ns);
 
 #endif /* UDEV_ENUMERATE_H_ */
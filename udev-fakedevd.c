@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Stand-in for devd(8) seqpacket socket to load-test monitors. Serves
+ * devd lines taken from files (one event per line, as read from
+ * /var/run/devd.pipe) or generated ones to every connected client at
+ * given rate. Like devd, event is dropped for client which can not keep
+ * up. Connections may be dropped periodically to exercise reconnects.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	MAX_CLIENTS	32
+#define	EVENT_MAX	1024
+
+struct events {
+	char **lines;
+	size_t count;
+	size_t size;
+};
+
+static int clients[MAX_CLIENTS];
+static int nclients;
+static unsigned long sent, overflows, drops;
+
+static void
+events_add(struct events *ev, const char *line, size_t len)
+{
+	char **tmp;
+
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		len--;
+	if (len == 0 || len >= EVENT_MAX - 1)
+		return;
+	if (ev->count == ev->size) {
+		ev->size = ev->size == 0 ? 64 : ev->size * 2;
+		tmp = realloc(ev->lines, ev->size * sizeof(char *));
+		if (tmp == NULL)
+			err(1, "realloc");
+		ev->lines = tmp;
+	}
+	/* Terminating LF is part of devd message */
+	if (asprintf(&ev->lines[ev->count], "%.*s\n", (int)len, line) < 0)
+		err(1, "asprintf");
+	ev->count++;
+}
+
+static void
+events_load(struct events *ev, const char *file)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *fp;
+
+	fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+	if (fp == NULL)
+		err(1, "%s", file);
+	while ((len = getline(&line, &size, fp)) > 0)
+		events_add(ev, line, len);
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+}
+
+/* Hotplug of input devices with occasional interface and bus events */
+static void
+events_generate(struct events *ev, unsigned long count)
+{
+	char line[EVENT_MAX];
+	unsigned long i, unit;
+	bool detach;
+
+	for (i = 0; i < count; i++) {
+		unit = i / 2 % 64;
+		/* Bus and interface events attach unit and detach it next */
+		detach = i / 8 % 2 != 0;
+		switch (i % 8) {
+		case 6:
+			snprintf(line, sizeof(line), "%cuhid%lu at bus=0 "
+			    "sernum=\"\" on uhub1", detach ? '-' : '+',
+			    i / 16 % 64);
+			break;
+		case 7:
+			snprintf(line, sizeof(line), "!system=IFNET "
+			    "subsystem=ue%lu type=%s", i / 16 % 64,
+			    detach ? "DETACH" : "ATTACH");
+			break;
+		default:
+			snprintf(line, sizeof(line), "!system=DEVFS "
+			    "subsystem=CDEV type=%s cdev=input/event%lu",
+			    i % 2 ? "DESTROY" : "CREATE", unit);
+		}
+		events_add(ev, line, strlen(line));
+	}
+}
+
+static void
+clients_accept(int lfd)
+{
+	int fd;
+
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		if (nclients == MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		clients[nclients++] = fd;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		err(1, "accept");
+}
+
+static void
+clients_close(void)
+{
+
+	while (nclients > 0)
+		close(clients[--nclients]);
+}
+
+/* Sleeps until at least count clients are connected */
+static void
+clients_wait(int lfd, int count)
+{
+	struct pollfd pfd = { .fd = lfd, .events = POLLIN };
+
+	clients_accept(lfd);
+	while (nclients < count) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			err(1, "poll");
+		clients_accept(lfd);
+	}
+}
+
+static void
+clients_send(const char *line)
+{
+	size_t len = strlen(line);
+	int i;
+
+	for (i = 0; i < nclients; i++) {
+		if (send(clients[i], line, len, MSG_DONTWAIT | MSG_NOSIGNAL) ==
+		    (ssize_t)len) {
+			sent++;
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+			overflows++;
+			continue;
+		}
+		/* Client went away */
+		close(clients[i]);
+		clients[i--] = clients[--nclients];
+	}
+}
+
+/* Removes stale socket but refuses to replace one somebody listens on */
+static void
+socket_remove_stale(const struct sockaddr_un *sa)
+{
+	struct stat st;
+	int fd, error;
+
+	if (lstat(sa->sun_path, &st) != 0)
+		return;
+	if (!S_ISSOCK(st.st_mode))
+		errx(1, "%s: exists and is not a socket", sa->sun_path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		err(1, "socket");
+	error = connect(fd, (const struct sockaddr *)sa, sizeof(*sa)) == 0 ?
+	    0 : errno;
+	close(fd);
+	if (error == 0)
+		errx(1, "%s: socket is in use", sa->sun_path);
+	if (error == ECONNREFUSED && unlink(sa->sun_path) != 0)
+		err(1, "%s", sa->sun_path);
+}
+
+static void
+timespec_add_ns(struct timespec *ts, uint64_t ns)
+{
+
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec += ns % 1000000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: udev-fakedevd [-c clients] [-d drop_every] "
+	    "[-g count] [-l loops] [-r rate] -s socket [file ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	const char *path = NULL;
+	struct events ev = { 0 };
+	struct timespec next, start, end;
+	unsigned long generate = 0, loops = 1, drop_every = 0, rate = 0;
+	unsigned long n = 0, l;
+	size_t i;
+	int lfd, ch, wait_clients = 1;
+	double elapsed;
+
+	while ((ch = getopt(argc, argv, "c:d:g:l:r:s:")) != -1) {
+		switch (ch) {
+		case 'c':
+			wait_clients = atoi(optarg);
+			if (wait_clients < 0 || wait_clients > MAX_CLIENTS)
+				usage();
+			break;
+		case 'd':
+			drop_every = strtoul(optarg, NULL, 10);
+			break;
+		case 'g':
+			generate = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			loops = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	/* No default to not ever hit socket of running devd */
+	if (path == NULL)
+		usage();
+
+	for (i = 0; i < (size_t)argc; i++)
+		events_load(&ev, argv[i]);
+	if (generate != 0)
+		events_generate(&ev, generate);
+	if (ev.count == 0)
+		errx(1, "no events to send");
+
+	if (strlen(path) >= sizeof(sa.sun_path))
+		errx(1, "%s: socket path is too long", path);
+	memcpy(sa.sun_path, path, strlen(path) + 1);
+	socket_remove_stale(&sa);
+	lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK,
+	    0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+	    listen(lfd, MAX_CLIENTS) != 0)
+		err(1, "%s", path);
+
+	clients_wait(lfd, wait_clients);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+	for (l = 0; l < loops; l++) {
+		for (i = 0; i < ev.count; i++, n++) {
+			if (rate != 0) {
+				timespec_add_ns(&next, 1000000000 / rate);
+				while (clock_nanosleep(CLOCK_MONOTONIC,
+				    TIMER_ABSTIME, &next, NULL) == EINTR)
+					;
+			}
+			if (drop_every != 0 && n != 0 && n % drop_every == 0) {
+				clients_close();
+				drops++;
+				/* Clients reconnect on their own schedule */
+				clients_wait(lfd, wait_clients);
+				if (rate != 0)
+					clock_gettime(CLOCK_MONOTONIC, &next);
+			} else
+				clients_accept(lfd);
+			clients_send(ev.lines[i]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "events %lu, sent %lu, overflows %lu, drops %lu, "
+	    "%.3f s, %.0f events/s\n", n, sent, overflows, drops, elapsed,
+	    elapsed > 0 ? n / elapsed : 0.0);
+
+	clients_close();
+	close(lfd);
+	unlink(path);
+	for (i = 0; i < ev.count; i++)
+		free(ev.lines[i]);
+	free(ev.lines);
+
+	return (0);
+}
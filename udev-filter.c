@@ -127,9 +127,14 @@ udev_filter_match(struct udev *udev, struct udev_filter_head *ufh,
 	bool ret = false;
 
 	memset(score, 0, sizeof(score));
+	STATS_INC(filter_evaluations);
 	subsystem = get_subsystem_by_syspath(syspath, &devtype);
-	if (strcmp(subsystem, UNKNOWN_SUBSYSTEM) == 0)
+	if (strcmp(subsystem, UNKNOWN_SUBSYSTEM) == 0) {
+		STATS_INC(filter_rejections);
+		TRACE(TRACE_FILTER_REJECT, syspath);
+		PROBE1(filter__reject, syspath);
 		return (0);
+	}
 
 	sysname = get_sysname_by_syspath(syspath);
 
@@ -155,6 +160,7 @@ udev_filter_match(struct udev *udev, struct udev_filter_head *ufh,
 				    UD_ACTION_NONE);
 			if (ud == NULL)
 				break;
+			udev_device_import_hwdb(ud);
 			if (fnmatch_list(
 			    udev_device_get_properties_list(ud), ufe))
 				score[ufe->type].matched = true;
@@ -220,6 +226,13 @@ out:
 	if (ud != NULL)
 		udev_device_unref(ud);
 
+	if (!ret)
+		STATS_INC(filter_rejections);
+	TRACE(ret ? TRACE_FILTER_MATCH : TRACE_FILTER_REJECT, syspath);
+	if (ret)
+		PROBE1(filter__match, syspath);
+	else
+		PROBE1(filter__reject, syspath);
 	return (ret);
 }
 
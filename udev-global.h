@@ -31,12 +31,17 @@
 #include "libudev.h"
 
 #include "utils.h"
+#include "utils-capture.h"
+#include "utils-probe.h"
+#include "utils-trace.h"
+#include "utils-stats.h"
 
 #include "udev.h"
 #include "udev-device.h"
 #include "udev-enumerate.h"
 #include "udev-filter.h"
 #include "udev-list.h"
+#include "udev-monitor.h"
 #include "udev-utils.h"
 
 #ifdef ENABLE_GPL
@@ -0,0 +1,668 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Compiler of hardware database sources into trie file read by libudev.
+ * Source syntax and output format follow systemd-hwdb.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "udev-hwdb.h"
+
+struct strbuf {
+	char *buf;
+	size_t len;
+	size_t size;
+	size_t *hash;		/* offset + 1 of deduplicated strings */
+	size_t hash_size;
+	size_t hash_count;
+};
+
+struct trie_node;
+
+struct trie_child {
+	uint8_t c;
+	struct trie_node *node;
+};
+
+struct trie_value {
+	size_t key_off;
+	size_t value_off;
+	size_t filename_off;
+	uint32_t line_number;
+	uint16_t file_priority;
+};
+
+struct trie_node {
+	size_t prefix_off;
+	struct trie_child *children;
+	size_t children_count;
+	struct trie_value *values;
+	size_t values_count;
+};
+
+struct trie {
+	struct trie_node *root;
+	struct strbuf strings;
+	size_t nodes_count;
+	size_t children_count;
+	size_t values_count;
+};
+
+struct match {
+	char *match;
+	struct match *next;
+};
+
+static bool strict;
+static int parse_errors;
+
+static void *
+xcalloc(size_t n, size_t size)
+{
+	void *p;
+
+	p = calloc(n, size);
+	if (p == NULL)
+		err(1, "calloc");
+	return (p);
+}
+
+static void *
+xrealloc(void *ptr, size_t size)
+{
+	void *p;
+
+	p = realloc(ptr, size);
+	if (p == NULL)
+		err(1, "realloc");
+	return (p);
+}
+
+static size_t
+strbuf_hash(const char *s, size_t len)
+{
+	size_t h = 2166136261u;
+
+	while (len-- > 0)
+		h = (h ^ (uint8_t)*s++) * 16777619u;
+	return (h);
+}
+
+static void
+strbuf_rehash(struct strbuf *sb)
+{
+	size_t *old = sb->hash, old_size = sb->hash_size, i, h, off, len;
+
+	sb->hash_size = old_size == 0 ? 1024 : old_size * 2;
+	sb->hash = xcalloc(sb->hash_size, sizeof(size_t));
+	for (i = 0; i < old_size; i++) {
+		if (old[i] == 0)
+			continue;
+		off = old[i] - 1;
+		len = strlen(sb->buf + off);
+		h = strbuf_hash(sb->buf + off, len) & (sb->hash_size - 1);
+		while (sb->hash[h] != 0)
+			h = (h + 1) & (sb->hash_size - 1);
+		sb->hash[h] = old[i];
+	}
+	free(old);
+}
+
+/* Adds string to the table once and returns its offset */
+static size_t
+strbuf_add(struct strbuf *sb, const char *s, size_t len)
+{
+	size_t h, off;
+
+	if (sb->len == 0) {
+		/* Offset 0 is reserved for empty string */
+		sb->size = 65536;
+		sb->buf = xcalloc(1, sb->size);
+		sb->len = 1;
+	}
+	if (len == 0)
+		return (0);
+
+	if (sb->hash_count * 2 >= sb->hash_size)
+		strbuf_rehash(sb);
+	h = strbuf_hash(s, len) & (sb->hash_size - 1);
+	while (sb->hash[h] != 0) {
+		off = sb->hash[h] - 1;
+		if (strncmp(sb->buf + off, s, len) == 0 &&
+		    sb->buf[off + len] == '\0')
+			return (off);
+		h = (h + 1) & (sb->hash_size - 1);
+	}
+
+	while (sb->len + len + 1 > sb->size) {
+		sb->size *= 2;
+		sb->buf = xrealloc(sb->buf, sb->size);
+	}
+	off = sb->len;
+	memcpy(sb->buf + off, s, len);
+	sb->buf[off + len] = '\0';
+	sb->len += len + 1;
+	sb->hash[h] = off + 1;
+	sb->hash_count++;
+
+	return (off);
+}
+
+static struct trie_node *
+trie_node_lookup(struct trie_node *node, uint8_t c)
+{
+	size_t i;
+
+	for (i = 0; i < node->children_count; i++)
+		if (node->children[i].c == c)
+			return (node->children[i].node);
+	return (NULL);
+}
+
+static void
+trie_node_add_child(struct trie *trie, struct trie_node *node,
+    struct trie_node *child, uint8_t c)
+{
+	size_t i;
+
+	node->children = xrealloc(node->children,
+	    (node->children_count + 1) * sizeof(struct trie_child));
+	/* Children are kept sorted for binary search at lookup time */
+	for (i = node->children_count; i > 0; i--) {
+		if (node->children[i - 1].c < c)
+			break;
+		node->children[i] = node->children[i - 1];
+	}
+	node->children[i].c = c;
+	node->children[i].node = child;
+	node->children_count++;
+	trie->children_count++;
+}
+
+static void
+trie_node_add_value(struct trie *trie, struct trie_node *node,
+    const struct trie_value *value)
+{
+	size_t i;
+
+	/* Strings are deduplicated so equal keys have equal offsets */
+	for (i = 0; i < node->values_count; i++) {
+		if (node->values[i].key_off == value->key_off) {
+			node->values[i] = *value;
+			return;
+		}
+	}
+
+	node->values = xrealloc(node->values,
+	    (node->values_count + 1) * sizeof(struct trie_value));
+	node->values[node->values_count++] = *value;
+	trie->values_count++;
+}
+
+static struct trie_node *
+trie_node_new(struct trie *trie)
+{
+
+	trie->nodes_count++;
+	return (xcalloc(1, sizeof(struct trie_node)));
+}
+
+static void
+trie_insert(struct trie *trie, const char *search,
+    const struct trie_value *value)
+{
+	struct trie_node *node, *child;
+	const char *prefix;
+	char *s;
+	size_t i, p;
+	uint8_t c;
+
+	node = trie->root;
+	i = 0;
+	for (;;) {
+		/* Walk along the prefix and split the node on mismatch */
+		for (p = 0; (c = trie->strings.buf[node->prefix_off + p]) != 0;
+		    p++) {
+			if (c == (uint8_t)search[i + p])
+				continue;
+
+			child = trie_node_new(trie);
+			*child = *node;
+			child->prefix_off = node->prefix_off + p + 1;
+			prefix = trie->strings.buf + node->prefix_off;
+			s = strndup(prefix, p);
+			if (s == NULL)
+				err(1, "strndup");
+			node->prefix_off = strbuf_add(&trie->strings, s, p);
+			free(s);
+			node->children = NULL;
+			node->children_count = 0;
+			node->values = NULL;
+			node->values_count = 0;
+			trie_node_add_child(trie, node, child, c);
+			break;
+		}
+		i += p;
+
+		c = search[i];
+		if (c == '\0') {
+			trie_node_add_value(trie, node, value);
+			return;
+		}
+
+		child = trie_node_lookup(node, c);
+		if (child == NULL) {
+			child = trie_node_new(trie);
+			child->prefix_off = strbuf_add(&trie->strings,
+			    search + i + 1, strlen(search + i + 1));
+			trie_node_add_child(trie, node, child, c);
+			trie_node_add_value(trie, child, value);
+			return;
+		}
+
+		node = child;
+		i++;
+	}
+}
+
+static void
+trie_node_free(struct trie_node *node)
+{
+	size_t i;
+
+	for (i = 0; i < node->children_count; i++)
+		trie_node_free(node->children[i].node);
+	free(node->children);
+	free(node->values);
+	free(node);
+}
+
+static void
+parse_error(const char *filename, uint32_t line_number, const char *msg,
+    const char *line)
+{
+
+	warnx("%s:%u: %s: %s", filename, line_number, msg, line);
+	parse_errors++;
+}
+
+static void
+match_list_free(struct match **head)
+{
+	struct match *m;
+
+	while ((m = *head) != NULL) {
+		*head = m->next;
+		free(m->match);
+		free(m);
+	}
+}
+
+static void
+insert_data(struct trie *trie, struct match *matches, char *line,
+    size_t filename_off, uint16_t file_priority, uint32_t line_number)
+{
+	struct trie_value value;
+	char *eq;
+
+	eq = strchr(line, '=');
+	if (eq == NULL) {
+		parse_error(trie->strings.buf + filename_off, line_number,
+		    "key-value pair expected", line);
+		return;
+	}
+	*eq = '\0';
+
+	/* Replace multiple leading spaces by a single space */
+	while ((line[0] == ' ' || line[0] == '\t') &&
+	    (line[1] == ' ' || line[1] == '\t'))
+		line++;
+	line[0] = ' ';
+	if (line[1] == '\0') {
+		parse_error(trie->strings.buf + filename_off, line_number,
+		    "empty key", eq + 1);
+		return;
+	}
+
+	value.key_off = strbuf_add(&trie->strings, line, strlen(line));
+	value.value_off = strbuf_add(&trie->strings, eq + 1, strlen(eq + 1));
+	value.filename_off = filename_off;
+	value.line_number = line_number;
+	value.file_priority = file_priority;
+	for (; matches != NULL; matches = matches->next)
+		trie_insert(trie, matches->match, &value);
+}
+
+static void
+import_file(struct trie *trie, const char *filename, uint16_t file_priority)
+{
+	enum { HW_NONE, HW_MATCH, HW_DATA } state = HW_NONE;
+	struct match *matches = NULL, *m;
+	char *line = NULL;
+	size_t linecap = 0, len, filename_off;
+	uint32_t line_number = 0;
+	ssize_t linelen;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		warn("%s", filename);
+		parse_errors++;
+		return;
+	}
+
+	filename_off = strbuf_add(&trie->strings, filename, strlen(filename));
+	while ((linelen = getline(&line, &linecap, f)) != -1) {
+		line_number++;
+		len = linelen;
+		while (len > 0 && strchr(" \t\r\n", line[len - 1]) != NULL)
+			len--;
+		line[len] = '\0';
+
+		if (line[0] == '#')
+			continue;
+
+		if (len == 0) {
+			if (state == HW_MATCH)
+				parse_error(filename, line_number,
+				    "property expected, ignoring record", "");
+			state = HW_NONE;
+			match_list_free(&matches);
+			continue;
+		}
+
+		if (line[0] == ' ' || line[0] == '\t') {
+			if (state == HW_NONE) {
+				parse_error(filename, line_number,
+				    "match expected", line);
+				continue;
+			}
+			state = HW_DATA;
+			insert_data(trie, matches, line, filename_off,
+			    file_priority, line_number);
+			continue;
+		}
+
+		if (state == HW_DATA) {
+			parse_error(filename, line_number,
+			    "property or empty line expected", line);
+			state = HW_NONE;
+			match_list_free(&matches);
+			continue;
+		}
+
+		m = xcalloc(1, sizeof(struct match));
+		m->match = strdup(line);
+		if (m->match == NULL)
+			err(1, "strdup");
+		m->next = matches;
+		matches = m;
+		state = HW_MATCH;
+	}
+
+	if (state == HW_MATCH)
+		parse_error(filename, line_number,
+		    "property expected, ignoring record", "");
+	match_list_free(&matches);
+	free(line);
+	fclose(f);
+}
+
+struct store {
+	FILE *f;
+	uint64_t pos;
+	uint64_t strings_off;
+};
+
+static void
+store_write(struct store *st, const void *buf, size_t len)
+{
+
+	if (fwrite(buf, len, 1, st->f) != 1)
+		err(1, "write");
+	st->pos += len;
+}
+
+/* Children are stored before parent so their offsets are known */
+static uint64_t
+trie_store_node(struct store *st, struct trie_node *node)
+{
+	struct trie_node_f n = { 0 };
+	struct trie_child_entry_f c = { 0 };
+	struct trie_value_entry2_f v = { 0 };
+	uint64_t *offs, off;
+	size_t i;
+
+	offs = xcalloc(node->children_count + 1, sizeof(uint64_t));
+	for (i = 0; i < node->children_count; i++)
+		offs[i] = trie_store_node(st, node->children[i].node);
+
+	off = st->pos;
+	n.prefix_off = htole64(st->strings_off + node->prefix_off);
+	n.children_count = node->children_count;
+	n.values_count = htole64(node->values_count);
+	store_write(st, &n, sizeof(n));
+
+	for (i = 0; i < node->children_count; i++) {
+		c.c = node->children[i].c;
+		c.child_off = htole64(offs[i]);
+		store_write(st, &c, sizeof(c));
+	}
+
+	for (i = 0; i < node->values_count; i++) {
+		v.key_off = htole64(st->strings_off + node->values[i].key_off);
+		v.value_off =
+		    htole64(st->strings_off + node->values[i].value_off);
+		v.filename_off =
+		    htole64(st->strings_off + node->values[i].filename_off);
+		v.line_number = htole32(node->values[i].line_number);
+		v.file_priority = htole16(node->values[i].file_priority);
+		store_write(st, &v, sizeof(v));
+	}
+
+	free(offs);
+	return (off);
+}
+
+static void
+trie_store(struct trie *trie, const char *filename)
+{
+	struct trie_header_f h = { 0 };
+	struct store st;
+	uint64_t nodes_len, root_off;
+	char *tmp;
+
+	nodes_len = trie->nodes_count * sizeof(struct trie_node_f) +
+	    trie->children_count * sizeof(struct trie_child_entry_f) +
+	    trie->values_count * sizeof(struct trie_value_entry2_f);
+
+	if (asprintf(&tmp, "%s.XXXXXX", filename) == -1)
+		err(1, "asprintf");
+	st.f = fdopen(mkstemp(tmp), "w");
+	if (st.f == NULL)
+		err(1, "%s", tmp);
+
+	/* Header is rewritten once root node offset is known */
+	st.pos = 0;
+	st.strings_off = sizeof(h) + nodes_len;
+	store_write(&st, &h, sizeof(h));
+	root_off = trie_store_node(&st, trie->root);
+	if (st.pos != st.strings_off)
+		errx(1, "node table size mismatch");
+	store_write(&st, trie->strings.buf, trie->strings.len);
+
+	memcpy(h.signature, HWDB_SIG, HWDB_SIG_LEN);
+	h.file_size = htole64(st.pos);
+	h.header_size = htole64(sizeof(struct trie_header_f));
+	h.node_size = htole64(sizeof(struct trie_node_f));
+	h.child_entry_size = htole64(sizeof(struct trie_child_entry_f));
+	h.value_entry_size = htole64(sizeof(struct trie_value_entry2_f));
+	h.nodes_root_off = htole64(root_off);
+	h.nodes_len = htole64(nodes_len);
+	h.strings_len = htole64(trie->strings.len);
+	if (fseek(st.f, 0, SEEK_SET) != 0)
+		err(1, "%s", tmp);
+	store_write(&st, &h, sizeof(h));
+
+	if (fchmod(fileno(st.f), 0444) != 0 || fclose(st.f) != 0)
+		err(1, "%s", tmp);
+	if (rename(tmp, filename) != 0)
+		err(1, "%s", filename);
+	free(tmp);
+}
+
+static int
+file_cmp(const void *a, const void *b)
+{
+	const char *f1 = *(char * const *)a, *f2 = *(char * const *)b;
+	const char *b1, *b2;
+
+	b1 = strrchr(f1, '/');
+	b2 = strrchr(f2, '/');
+	return (strcmp(b1 != NULL ? b1 + 1 : f1, b2 != NULL ? b2 + 1 : f2));
+}
+
+static void
+add_file(char ***files, size_t *nfiles, const char *path)
+{
+
+	*files = xrealloc(*files, (*nfiles + 1) * sizeof(char *));
+	(*files)[*nfiles] = strdup(path);
+	if ((*files)[*nfiles] == NULL)
+		err(1, "strdup");
+	(*nfiles)++;
+}
+
+static void
+add_path(char ***files, size_t *nfiles, const char *path)
+{
+	struct dirent *de;
+	struct stat sb;
+	char *file;
+	size_t len;
+	DIR *dir;
+
+	if (stat(path, &sb) != 0) {
+		warn("%s", path);
+		parse_errors++;
+		return;
+	}
+	if (!S_ISDIR(sb.st_mode)) {
+		add_file(files, nfiles, path);
+		return;
+	}
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		warn("%s", path);
+		parse_errors++;
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		len = strlen(de->d_name);
+		if (de->d_name[0] == '.' || len < 5 ||
+		    strcmp(de->d_name + len - 5, ".hwdb") != 0)
+			continue;
+		if (asprintf(&file, "%s/%s", path, de->d_name) == -1)
+			err(1, "asprintf");
+		add_file(files, nfiles, file);
+		free(file);
+	}
+	closedir(dir);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: udev-hwdb [-s] [-o output] [path ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *output = HWDB_BIN_PATH;
+	struct trie trie = { 0 };
+	char **files = NULL;
+	size_t nfiles = 0, i;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "o:s")) != -1) {
+		switch (ch) {
+		case 'o':
+			output = optarg;
+			break;
+		case 's':
+			strict = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0)
+		add_path(&files, &nfiles, HWDB_SRC_PATH);
+	for (i = 0; i < (size_t)argc; i++)
+		add_path(&files, &nfiles, argv[i]);
+
+	/* Files sorting later by name override earlier ones */
+	qsort(files, nfiles, sizeof(char *), file_cmp);
+
+	strbuf_add(&trie.strings, "", 0);
+	trie.root = trie_node_new(&trie);
+	for (i = 0; i < nfiles; i++) {
+		import_file(&trie, files[i], i + 1);
+		free(files[i]);
+	}
+	free(files);
+
+	if (strict && parse_errors != 0)
+		errx(1, "%d errors, database is not written", parse_errors);
+
+	trie_store(&trie, output);
+
+	trie_node_free(trie.root);
+	free(trie.strings.buf);
+	free(trie.strings.hash);
+
+	return (0);
+}
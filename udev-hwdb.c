@@ -23,25 +23,125 @@
  * SUCH DAMAGE.
  */
 
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "udev-global.h"
+#include "udev-hwdb.h"
+
+#define	HWDB_LINE_MAX	4096
+
+static const char * const hwdb_bin_paths[] = {
+	HWDB_BIN_PATH,
+#ifdef __linux__
+	"/etc/udev/hwdb.bin",
+	"/usr/lib/udev/hwdb.bin",
+#endif
+};
+
+/* Winning value for a property key during single lookup */
+struct hwdb_match {
+	const char *key;
+	const struct trie_value_entry_f *entry;
+};
+
+/* Pattern accumulated during glob matching of trie subtree */
+struct hwdb_linebuf {
+	char buf[HWDB_LINE_MAX];
+	size_t len;
+	bool overflow;
+};
 
 struct udev_hwdb {
 	int refcount;
+	const char *map;
+	size_t map_size;
+	const struct trie_header_f *head;
+	struct udev_list properties;
+	struct hwdb_match *matches;
+	size_t nmatches;
+	size_t matches_max;
 };
 
+static int
+hwdb_open(struct udev_hwdb *uh, const char *path)
+{
+	const struct trie_header_f *head;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return (-1);
+
+	if (fstat(fd, &st) != 0 ||
+	    (size_t)st.st_size < sizeof(struct trie_header_f)) {
+		close(fd);
+		return (-1);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (-1);
+
+	head = map;
+	if (memcmp(head->signature, HWDB_SIG, HWDB_SIG_LEN) != 0 ||
+	    le64toh(head->file_size) != (uint64_t)st.st_size ||
+	    le64toh(head->node_size) < sizeof(struct trie_node_f) ||
+	    le64toh(head->child_entry_size) <
+	    sizeof(struct trie_child_entry_f) ||
+	    le64toh(head->value_entry_size) <
+	    sizeof(struct trie_value_entry_f) ||
+	    le64toh(head->nodes_root_off) >= (uint64_t)st.st_size) {
+		ERR("%s: invalid hwdb file", path);
+		munmap(map, st.st_size);
+		return (-1);
+	}
+
+	uh->map = map;
+	uh->map_size = st.st_size;
+	uh->head = head;
+	return (0);
+}
+
 LIBUDEV_EXPORT struct udev_hwdb *
 udev_hwdb_new(struct udev *udev)
 {
 	struct udev_hwdb *uh;
+	const char *path;
+	size_t i;
 
 	TRC("(%p)", udev);
 	uh = calloc(1, sizeof(struct udev_hwdb));
-	if (uh != NULL)
-		uh->refcount = 1;
+	if (uh == NULL)
+		return (NULL);
+
+	uh->refcount = 1;
+	udev_list_init(&uh->properties);
+	/* Missing database is not an error, lookups just find nothing */
+	path = secure_getenv("UDEV_HWDB_BIN");
+	if (path != NULL && path[0] != '\0') {
+		/* Replaces default locations. Test aid */
+		hwdb_open(uh, path);
+		return (uh);
+	}
+	for (i = 0; i < nitems(hwdb_bin_paths); i++)
+		if (hwdb_open(uh, hwdb_bin_paths[i]) == 0)
+			break;
+
 	return (uh);
 }
 
@@ -58,17 +158,281 @@ LIBUDEV_EXPORT struct udev_hwdb *
 udev_hwdb_unref(struct udev_hwdb *uh)
 {
 	TRC("(%p)", uh);
-	if (uh != NULL && --uh->refcount == 0)
+	if (uh != NULL && --uh->refcount == 0) {
+		if (uh->map != NULL)
+			munmap((void *)uh->map, uh->map_size);
+		udev_list_free(&uh->properties);
+		free(uh->matches);
 		free(uh);
+	}
+	return (NULL);
+}
+
+static inline const char *
+trie_string(struct udev_hwdb *uh, uint64_t off)
+{
+
+	return (uh->map + le64toh(off));
+}
+
+static inline const struct trie_node_f *
+trie_node_from_off(struct udev_hwdb *uh, uint64_t off)
+{
+
+	return ((const struct trie_node_f *)(uh->map + le64toh(off)));
+}
+
+static inline const struct trie_child_entry_f *
+trie_node_child(struct udev_hwdb *uh, const struct trie_node_f *node,
+    size_t idx)
+{
+	const char *base = (const char *)node;
+
+	base += le64toh(uh->head->node_size);
+	base += idx * le64toh(uh->head->child_entry_size);
+	return ((const struct trie_child_entry_f *)base);
+}
+
+static inline const struct trie_value_entry_f *
+trie_node_value(struct udev_hwdb *uh, const struct trie_node_f *node,
+    size_t idx)
+{
+	const char *base = (const char *)node;
+
+	base += le64toh(uh->head->node_size);
+	base += node->children_count * le64toh(uh->head->child_entry_size);
+	base += idx * le64toh(uh->head->value_entry_size);
+	return ((const struct trie_value_entry_f *)base);
+}
+
+static const struct trie_node_f *
+trie_node_lookup(struct udev_hwdb *uh, const struct trie_node_f *node,
+    uint8_t c)
+{
+	const struct trie_child_entry_f *child;
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = node->children_count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		child = trie_node_child(uh, node, mid);
+		if (child->c == c)
+			return (trie_node_from_off(uh, child->child_off));
+		if (child->c < c)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
 	return (NULL);
 }
 
+/*
+ * Keep only one value per key. Duplicates are ordered by file priority
+ * and line number when the database carries them.
+ */
+static int
+hwdb_add_property(struct udev_hwdb *uh, const struct trie_value_entry_f *entry)
+{
+	const struct trie_value_entry2_f *new2, *old2;
+	struct hwdb_match *matches;
+	const char *key;
+	size_t i, max;
+
+	key = trie_string(uh, entry->key_off);
+	/* Keys without leading space are reserved for future extensions */
+	if (key[0] != ' ')
+		return (0);
+	key++;
+
+	for (i = 0; i < uh->nmatches; i++) {
+		if (strcmp(uh->matches[i].key, key) != 0)
+			continue;
+		if (le64toh(uh->head->value_entry_size) >=
+		    sizeof(struct trie_value_entry2_f)) {
+			new2 = (const struct trie_value_entry2_f *)entry;
+			old2 = (const struct trie_value_entry2_f *)
+			    uh->matches[i].entry;
+			if (le16toh(new2->file_priority) <
+			    le16toh(old2->file_priority))
+				return (0);
+			if (le16toh(new2->file_priority) ==
+			    le16toh(old2->file_priority) &&
+			    le32toh(new2->line_number) <
+			    le32toh(old2->line_number))
+				return (0);
+		}
+		uh->matches[i].entry = entry;
+		return (0);
+	}
+
+	if (uh->nmatches == uh->matches_max) {
+		max = uh->matches_max == 0 ? 16 : uh->matches_max * 2;
+		matches = realloc(uh->matches, max * sizeof(struct hwdb_match));
+		if (matches == NULL)
+			return (-1);
+		uh->matches = matches;
+		uh->matches_max = max;
+	}
+	uh->matches[uh->nmatches].key = key;
+	uh->matches[uh->nmatches].entry = entry;
+	uh->nmatches++;
+
+	return (0);
+}
+
+static inline void
+linebuf_add(struct hwdb_linebuf *lb, const char *s, size_t len)
+{
+
+	if (lb->len + len >= sizeof(lb->buf)) {
+		lb->overflow = true;
+		return;
+	}
+	memcpy(lb->buf + lb->len, s, len);
+	lb->len += len;
+	lb->buf[lb->len] = '\0';
+}
+
+static inline void
+linebuf_rem(struct hwdb_linebuf *lb, size_t len)
+{
+
+	lb->len -= len;
+	lb->buf[lb->len] = '\0';
+}
+
+/* Match whole subtree against glob patterns built along the way */
+static int
+trie_fnmatch(struct udev_hwdb *uh, const struct trie_node_f *node, size_t p,
+    struct hwdb_linebuf *lb, const char *search)
+{
+	const struct trie_child_entry_f *child;
+	const char *prefix;
+	uint64_t i, count;
+	size_t len;
+	char c;
+
+	prefix = trie_string(uh, node->prefix_off);
+	len = strlen(prefix + p);
+	linebuf_add(lb, prefix + p, len);
+	if (lb->overflow) {
+		ERR("hwdb pattern is too long");
+		return (-1);
+	}
+
+	for (i = 0; i < node->children_count; i++) {
+		child = trie_node_child(uh, node, i);
+		c = child->c;
+		linebuf_add(lb, &c, 1);
+		if (trie_fnmatch(uh, trie_node_from_off(uh, child->child_off),
+		    0, lb, search) != 0)
+			return (-1);
+		linebuf_rem(lb, 1);
+	}
+
+	count = le64toh(node->values_count);
+	if (count != 0 && fnmatch(lb->buf, search, 0) == 0)
+		for (i = 0; i < count; i++)
+			if (hwdb_add_property(uh,
+			    trie_node_value(uh, node, i)) != 0)
+				return (-1);
+
+	linebuf_rem(lb, len);
+	return (0);
+}
+
+static int
+trie_search(struct udev_hwdb *uh, const char *search)
+{
+	static const char globs[] = { '*', '?', '[' };
+	const struct trie_node_f *node, *child;
+	struct hwdb_linebuf lb;
+	const char *prefix;
+	uint64_t n, count;
+	size_t i, j, p;
+	char c;
+
+	lb.len = 0;
+	lb.buf[0] = '\0';
+	lb.overflow = false;
+	i = 0;
+	node = trie_node_from_off(uh, uh->head->nodes_root_off);
+	while (node != NULL) {
+		p = 0;
+		if (node->prefix_off != 0) {
+			prefix = trie_string(uh, node->prefix_off);
+			for (; (c = prefix[p]) != '\0'; p++) {
+				if (c == '*' || c == '?' || c == '[')
+					return (trie_fnmatch(uh, node, p, &lb,
+					    search + i + p));
+				if (c != search[i + p])
+					return (0);
+			}
+			i += p;
+		}
+
+		for (j = 0; j < nitems(globs); j++) {
+			child = trie_node_lookup(uh, node, globs[j]);
+			if (child == NULL)
+				continue;
+			linebuf_add(&lb, &globs[j], 1);
+			if (trie_fnmatch(uh, child, 0, &lb, search + i) != 0)
+				return (-1);
+			linebuf_rem(&lb, 1);
+		}
+
+		if (search[i] == '\0') {
+			count = le64toh(node->values_count);
+			for (n = 0; n < count; n++)
+				if (hwdb_add_property(uh,
+				    trie_node_value(uh, node, n)) != 0)
+					return (-1);
+			return (0);
+		}
+
+		node = trie_node_lookup(uh, node, search[i]);
+		i++;
+	}
+
+	return (0);
+}
+
 LIBUDEV_EXPORT struct udev_list_entry *
 udev_hwdb_get_properties_list_entry(struct udev_hwdb *uh, const char *modalias,
     unsigned int flags)
 {
+	size_t i;
+
 	TRC("(%p, %s, %u)", uh, modalias, flags);
-	UNIMPL();
-	errno = EINVAL;
-	return (NULL);
+	if (uh == NULL || modalias == NULL) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	udev_list_free(&uh->properties);
+	if (uh->map == NULL) {
+		errno = ENOENT;
+		return (NULL);
+	}
+
+	uh->nmatches = 0;
+	if (trie_search(uh, modalias) != 0) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	for (i = 0; i < uh->nmatches; i++) {
+		if (udev_list_insert(&uh->properties, uh->matches[i].key,
+		    trie_string(uh, uh->matches[i].entry->value_off)) == -1) {
+			udev_list_free(&uh->properties);
+			errno = ENOMEM;
+			return (NULL);
+		}
+	}
+
+	if (uh->nmatches == 0)
+		errno = ENOENT;
+	return (udev_list_entry_get_first(&uh->properties));
 }
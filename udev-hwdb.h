@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef UDEV_HWDB_H_
+#define UDEV_HWDB_H_
+
+#include <stdint.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_ENDIAN_H
+#include <sys/endian.h>
+#else
+#include <endian.h>
+#endif
+
+/*
+ * On-disk layout of compiled hardware database. It matches systemd hwdb.bin
+ * so the files are interchangeable. All integers are little endian.
+ * The file consists of a header followed by trie nodes and a string table.
+ * Each node is immediately followed by its children sorted by character and
+ * by its values. Property keys are prefixed with a space.
+ */
+#define	HWDB_SIG	"KSLPHHRH"
+#define	HWDB_SIG_LEN	8
+
+#ifndef HWDB_BIN_PATH
+#define	HWDB_BIN_PATH	SYSCONFDIR "/udev/hwdb.bin"
+#endif
+#ifndef HWDB_SRC_PATH
+#define	HWDB_SRC_PATH	SYSCONFDIR "/udev/hwdb.d"
+#endif
+
+struct trie_header_f {
+	uint8_t signature[HWDB_SIG_LEN];
+	uint64_t tool_version;
+	uint64_t file_size;
+	uint64_t header_size;
+	uint64_t node_size;
+	uint64_t child_entry_size;
+	uint64_t value_entry_size;
+	uint64_t nodes_root_off;
+	uint64_t nodes_len;
+	uint64_t strings_len;
+} __attribute__((packed));
+
+struct trie_node_f {
+	uint64_t prefix_off;
+	uint8_t children_count;
+	uint8_t padding[7];
+	uint64_t values_count;
+} __attribute__((packed));
+
+struct trie_child_entry_f {
+	uint8_t c;
+	uint8_t padding[7];
+	uint64_t child_off;
+} __attribute__((packed));
+
+struct trie_value_entry_f {
+	uint64_t key_off;
+	uint64_t value_off;
+} __attribute__((packed));
+
+/* Version 2 entries carry the origin used to resolve duplicate keys */
+struct trie_value_entry2_f {
+	uint64_t key_off;
+	uint64_t value_off;
+	uint64_t filename_off;
+	uint32_t line_number;
+	uint16_t file_priority;
+	uint16_t padding;
+} __attribute__((packed));
+
+#endif /* UDEV_HWDB_H_ */
@@ -38,14 +38,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define	DEVD_SOCK_PATH		"/var/run/devd.seqpacket.pipe"
 #define	DEVD_RECONNECT_INTERVAL	1000	/* reconnect after 1 second */
+#define	DEVD_LINE_MAX		1024
 
 STAILQ_HEAD(udev_monitor_queue_head, udev_monitor_queue_entry);
 struct udev_monitor_queue_entry {
 	struct udev_device *ud;
+	uint64_t ts;		/* time event was received */
 	STAILQ_ENTRY(udev_monitor_queue_entry) next;
 };
 
@@ -57,6 +60,10 @@ struct udev_monitor {
 	struct udev_monitor_queue_head queue;
 	pthread_mutex_t mtx;
 	pthread_t thread;
+	bool running;		/* thread is started */
+	int capture_fd;		/* -1 if received events are not captured */
+	char *replay_path;	/* capture fed instead of devd events */
+	bool replay_realtime;
 };
 
 LIBUDEV_EXPORT struct udev_device *
@@ -78,20 +85,24 @@ udev_monitor_receive_device(struct udev_monitor *um)
 	STAILQ_REMOVE_HEAD(&um->queue, next);
 	pthread_mutex_unlock(&um->mtx);
 	ud = umqe->ud;
+	udev_stats_latency(umqe->ts);
 	free(umqe);
+	TRACE(TRACE_QUEUE_POP, _udev_device_get_syspath(ud));
+	PROBE1(queue__dequeue, _udev_device_get_syspath(ud));
 
 	return (ud);
 }
 
 static int
 udev_monitor_send_device(struct udev_monitor *um, const char *syspath,
-    int action)
+    int action, uint64_t ts)
 {
 	struct udev_monitor_queue_entry *umqe;
 
 	umqe = calloc(1, sizeof(struct udev_monitor_queue_entry));
 	if (umqe == NULL)
 		return (-1);
+	umqe->ts = ts;
 
 	umqe->ud = udev_device_new_common(um->udev, syspath, action);
 	if (umqe->ud == NULL) {
@@ -102,6 +113,8 @@ udev_monitor_send_device(struct udev_monitor *um, const char *syspath,
 	pthread_mutex_lock(&um->mtx);
 	STAILQ_INSERT_TAIL(&um->queue, umqe, next);
 	pthread_mutex_unlock(&um->mtx);
+	TRACE(TRACE_QUEUE_PUSH, syspath);
+	PROBE2(queue__enqueue, syspath, action);
 
 	if (write(um->fds[1], "*", 1) != 1) {
 		pthread_mutex_lock(&um->mtx);
@@ -115,43 +128,184 @@ udev_monitor_send_device(struct udev_monitor *um, const char *syspath,
 	return (0);
 }
 
-static int
+static const struct {
+	const char *name;
+	int (*monitor)(char *msg, char *syspath, size_t syspathlen);
+} devd_backends[] = {
+	{ "dev", udev_dev_monitor },
+	{ "sys", udev_sys_monitor },
+	{ "pci", udev_pci_monitor },
+	{ "net", udev_net_monitor },
+};
+
+int
 parse_devd_message(char *msg, char *syspath, size_t syspathlen)
 {
+	size_t i;
+	int action = UD_ACTION_NONE;
+
+	for (i = 0; i < nitems(devd_backends) && action == UD_ACTION_NONE;
+	    i++) {
+		action = devd_backends[i].monitor(msg, syspath, syspathlen);
+		PROBE3(monitor__parse, devd_backends[i].name, action,
+		    action != UD_ACTION_NONE ? syspath : NULL);
+	}
+
+	return (action);
+}
+
+/* Runs devd line through parser and filters. Line may be modified */
+static void
+udev_monitor_process(struct udev_monitor *um, char *ev, uint64_t ts)
+{
+	char syspath[DEV_PATH_MAX], raw[DEVD_LINE_MAX];
+	size_t raw_len = 0;
 	int action;
 
-	action = udev_dev_monitor(msg, syspath, syspathlen);
-	if (action == UD_ACTION_NONE)
-		action = udev_sys_monitor(msg, syspath, syspathlen);
-	if (action == UD_ACTION_NONE)
-		action = udev_pci_monitor(msg, syspath, syspathlen);
-	if (action == UD_ACTION_NONE)
-		action = udev_net_monitor(msg, syspath, syspathlen);
+	STATS_INC(devd_received);
+	TRACE(TRACE_DEVD_RECV, NULL);
+	PROBE1(devd__receive, ev);
+	/* Parsers cut message, so raw line is saved for capture */
+	if (um->capture_fd >= 0) {
+		raw_len = strlcpy(raw, ev, sizeof(raw));
+		if (raw_len >= sizeof(raw))
+			raw_len = sizeof(raw) - 1;
+	}
+	/* Detached driver instance may come back as other device */
+	if (ev[0] == DEVD_EVENT_DETACH)
+		parent_cache_forget(udev_get_parent_cache(um->udev),
+		    ev + 1, strcspn(ev + 1, " "));
+#ifdef HAVE_DEVINFO_H
+	/* Cached device tree is stale after any (de)attach */
+	if (ev[0] == DEVD_EVENT_ATTACH || ev[0] == DEVD_EVENT_DETACH)
+		scandev_invalidate();
+#endif
+	action = parse_devd_message(ev, syspath, sizeof(syspath));
+	TRACE(TRACE_DEVD_PARSE, action != UD_ACTION_NONE ? syspath : NULL);
+	if (um->capture_fd >= 0 &&
+	    capture_write(um->capture_fd, ts, raw, raw_len, action,
+	    action != UD_ACTION_NONE ? syspath : NULL) != 0)
+		ERR("Failed to write capture record");
+	if (action == UD_ACTION_NONE) {
+		STATS_INC(devd_dropped);
+		return;
+	}
+	STATS_INC(devd_parsed);
+	STATS_INC(events[udev_stats_subsystem(
+	    get_subsystem_by_syspath(syspath, NULL))]);
+
+	/* Interface data may change on any network event */
+	if (strncmp(syspath, "/net/", 5) == 0)
+		net_snapshot_invalidate(udev_get_net_snapshot(um->udev));
+	if (action == UD_ACTION_REMOVE && syspath_is_devpath(syspath))
+		devnum_index_forget(udev_get_devnum_index(um->udev), syspath);
+	if (strncmp(syspath, "/pci/", 5) == 0)
+		pci_table_invalidate(udev_get_pci_table(um->udev));
+	if (udev_filter_match(um->udev, &um->filters, syspath))
+		udev_monitor_send_device(um, syspath, action, ts);
+}
 
-	return (action);
+/*
+ * Feeds capture to the monitor at maximum or recorded speed. Returns -1
+ * if monitor is closed meanwhile.
+ */
+static int
+udev_monitor_replay(struct udev_monitor *um)
+{
+	struct capture_record rec;
+	struct pollfd pfd = { .fd = um->fds[1], .events = 0 };
+	char ev[DEVD_LINE_MAX], syspath[DEV_PATH_MAX];
+	uint64_t start = 0, first = 0, now;
+	struct timespec tmo;
+	int64_t delay;
+	unsigned int n = 0;
+	FILE *fp;
+	int ret;
+
+	fp = capture_open_read(um->replay_path);
+	if (fp == NULL)
+		return (0);
+
+	while ((ret = capture_read(fp, &rec, ev, sizeof(ev), syspath,
+	    sizeof(syspath))) > 0) {
+		now = udev_stats_now();
+		if (start == 0) {
+			start = now;
+			first = rec.ts;
+		}
+		delay = um->replay_realtime ?
+		    (int64_t)(rec.ts - first) - (int64_t)(now - start) : 0;
+		if (delay < 0)
+			delay = 0;
+		tmo.tv_sec = delay / 1000000000;
+		tmo.tv_nsec = delay % 1000000000;
+		/* Sleep is cut short if udev_monitor is finishing */
+		if ((delay > 0 || ++n % 64 == 0) &&
+		    ppoll(&pfd, 1, &tmo, NULL) > 0) {
+			fclose(fp);
+			return (-1);
+		}
+		udev_monitor_process(um, ev, udev_stats_now());
+	}
+	if (ret < 0)
+		ERR("Capture %s is truncated", um->replay_path);
+	fclose(fp);
+
+	return (0);
+}
+
+static void
+udev_monitor_net_event(const char *syspath, int action, void *arg)
+{
+	struct udev_monitor *um = arg;
+	uint64_t ts = udev_stats_now();
+
+	PROBE3(monitor__parse, "net", action, syspath);
+	STATS_INC(events[udev_stats_subsystem(
+	    get_subsystem_by_syspath(syspath, NULL))]);
+	if (udev_filter_match(um->udev, &um->filters, syspath))
+		udev_monitor_send_device(um, syspath, action, ts);
 }
 
 static void *
 udev_monitor_thread(void *args)
 {
 	struct udev_monitor *um = args;
-	char ev[1024], syspath[DEV_PATH_MAX];
-	struct pollfd fds[2];
-	nfds_t nfds;
+	char ev[DEVD_LINE_MAX];
+	struct pollfd fds[3];
 	ssize_t len;
-	int devd_fd = -1, ret, action, timeout;
+	int devd_fd = -1, net_fd, ret, timeout;
 	sigset_t set;
-	const static struct sockaddr_un sa = {
+	struct sockaddr_un sa = {
 		.sun_family = AF_UNIX,
 		.sun_path = DEVD_SOCK_PATH,
 	};
 
+	if (udev_get_devd_socket(um->udev) != NULL)
+		strlcpy(sa.sun_path, udev_get_devd_socket(um->udev),
+		    sizeof(sa.sun_path));
+
 	sigfillset(&set);
 	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
+	/* Replayed events replace live ones. Wait for close afterwards */
+	if (um->replay_path != NULL) {
+		fds[0].fd = um->fds[1];
+		fds[0].events = 0;
+		if (udev_monitor_replay(um) == 0)
+			while (poll(fds, 1, -1) == -1 && errno == EINTR)
+				;
+		return (NULL);
+	}
+
+	/* Link events which are not reported by devd. Optional */
+	net_fd = udev_net_monitor_open();
+
 	fds[0].fd = um->fds[1];
 	fds[0].events = 0;
 	fds[1].events = POLLIN;
+	fds[2].fd = net_fd;
+	fds[2].events = POLLIN;
 
 	for (;;) {
 		if (devd_fd < 0 &&
@@ -161,27 +315,26 @@ udev_monitor_thread(void *args)
 			devd_fd = -1;
 		}
 
-		if (devd_fd < 0) {
-			nfds = 1;
-			timeout = DEVD_RECONNECT_INTERVAL;
-		} else {
-			fds[1].fd = devd_fd;
-			nfds = 2;
-			timeout = -1;
-		}
+		/* poll() skips negative descriptors */
+		fds[1].fd = devd_fd;
+		timeout = devd_fd < 0 ? DEVD_RECONNECT_INTERVAL : -1;
 
-		ret = poll(fds, nfds, timeout);
+		ret = poll(fds, nitems(fds), timeout);
 		if (ret == -1 && errno == EINTR)
 			continue;
 		if (ret == -1)
 			break;
 
-		/* edev_monitor is finishing */
-		if (fds[0].revents & POLLHUP)
+		/* edev_monitor is finishing. Linux reports POLLERR here */
+		if (fds[0].revents & (POLLHUP | POLLERR))
 			break;
 
+		if (fds[2].revents & POLLIN)
+			udev_net_monitor_receive(net_fd, um->udev,
+			    udev_monitor_net_event, um);
+
 		/* connection respawn timer expired */
-		if (ret == 0 || devd_fd < 1)
+		if (ret == 0 || devd_fd < 0)
 			continue;
 
 		if (fds[1].revents & POLLIN) {
@@ -193,10 +346,7 @@ udev_monitor_thread(void *args)
 			}
 			/* Replace terminating LF with 0 to make C-string */
 			ev[len - 1] = '\0';
-			action = parse_devd_message(ev, syspath, sizeof(syspath));
-			if (action != UD_ACTION_NONE &&
-			    udev_filter_match(um->udev, &um->filters, syspath))
-				udev_monitor_send_device(um, syspath, action);
+			udev_monitor_process(um, ev, udev_stats_now());
 		}
 
 		if (fds[1].revents & POLLHUP) {
@@ -207,6 +357,8 @@ udev_monitor_thread(void *args)
 
 	if (devd_fd >= 0)
 		close(devd_fd);
+	if (net_fd >= 0)
+		close(net_fd);
 
 	return (NULL);
 }
@@ -233,10 +385,51 @@ udev_monitor_new_from_netlink(struct udev *udev, const char *name)
 	udev_filter_init(&um->filters);
 	STAILQ_INIT(&um->queue);
 	pthread_mutex_init(&um->mtx, NULL);
+	um->capture_fd = -1;
+	udev_monitor_set_capture(um, secure_getenv("UDEV_CAPTURE"));
+	udev_monitor_set_replay(um, secure_getenv("UDEV_REPLAY"),
+	    secure_getenv("UDEV_REPLAY_REALTIME") != NULL);
 
 	return (um);
 }
 
+/*
+ * Tees devd events received by monitor into capture file. Thread reads
+ * capture settings unlocked so they are fixed once receiving is enabled.
+ */
+LIBUDEV_EXPORT int
+udev_monitor_set_capture(struct udev_monitor *um, const char *path)
+{
+
+	TRC("(%p, %s)", um, path);
+	if (um->running)
+		return (-EBUSY);
+	if (um->capture_fd >= 0)
+		close(um->capture_fd);
+	um->capture_fd = path != NULL && path[0] != '\0' ?
+	    capture_open(path) : -1;
+	return (path != NULL && path[0] != '\0' && um->capture_fd < 0 ?
+	    -errno : 0);
+}
+
+/* Makes monitor replay capture instead of listening to devd */
+LIBUDEV_EXPORT int
+udev_monitor_set_replay(struct udev_monitor *um, const char *path,
+    int realtime)
+{
+	char *copy = NULL;
+
+	TRC("(%p, %s, %d)", um, path, realtime);
+	if (um->running)
+		return (-EBUSY);
+	if (path != NULL && path[0] != '\0' && (copy = strdup(path)) == NULL)
+		return (-ENOMEM);
+	free(um->replay_path);
+	um->replay_path = copy;
+	um->replay_realtime = realtime != 0;
+	return (0);
+}
+
 LIBUDEV_EXPORT int
 udev_monitor_filter_add_match_subsystem_devtype(struct udev_monitor *um,
     const char *subsystem, const char *devtype)
@@ -263,6 +456,7 @@ udev_monitor_enable_receiving(struct udev_monitor *um)
 		ERR("thread_create failed");
 		return (-1);
 	}
+	um->running = true;
 
 	return (0);
 }
@@ -308,6 +502,9 @@ udev_monitor_unref(struct udev_monitor *um)
 		udev_filter_free(&um->filters);
 		udev_monitor_queue_drop(&um->queue);
 		pthread_mutex_destroy(&um->mtx);
+		if (um->capture_fd >= 0)
+			close(um->capture_fd);
+		free(um->replay_path);
 		_udev_unref(um->udev);
 		free(um);
 	}
@@ -33,33 +33,434 @@
 #include <net/if_dl.h>
 #endif
 
+#ifdef __linux__
+#include <linux/if_packet.h>
+#endif
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#elif defined(HAVE_NET_ROUTE_H)
+#include <net/route.h>
+#endif
+
+#include <errno.h>
 #include <ifaddrs.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #ifndef AF_LINK
 #define	AF_LINK	AF_PACKET
 #endif
 
-int
-udev_net_enumerate(struct udev_enumerate *ue)
+#define	NETLINK_BUF_SIZE	32768
+
+static int
+net_iface_cmp(const void *a, const void *b)
+{
+	const struct net_iface *ni1 = a, *ni2 = b;
+
+	return (strncmp(ni1->name, ni2->name, IFNAMSIZ));
+}
+
+static void
+net_iface_fill(struct net_iface *ni, struct ifaddrs *ifa)
+{
+#ifdef HAVE_NET_IF_DL_H
+	struct sockaddr_dl *sdl = (struct sockaddr_dl *)ifa->ifa_addr;
+
+	ni->ifindex = LLINDEX(sdl);
+	ni->addr_len = sdl->sdl_alen;
+	if (sdl->sdl_alen == ETHER_ADDR_LEN)
+		memcpy(ni->addr, LLADDR(sdl), ETHER_ADDR_LEN);
+#elif defined(__linux__)
+	struct sockaddr_ll *sll = (struct sockaddr_ll *)ifa->ifa_addr;
+
+	ni->ifindex = sll->sll_ifindex;
+	ni->addr_len = sll->sll_halen;
+	if (sll->sll_halen == ETHER_ADDR_LEN)
+		memcpy(ni->addr, sll->sll_addr, ETHER_ADDR_LEN);
+#else
+	ni->ifindex = if_nametoindex(ifa->ifa_name);
+#endif
+}
+
+static void
+net_snapshot_set(struct net_snapshot *ns, struct net_iface *ifaces,
+    size_t count)
+{
+
+	qsort(ifaces, count, sizeof(struct net_iface), net_iface_cmp);
+	free(ns->ifaces);
+	ns->ifaces = ifaces;
+	ns->count = count;
+	ns->valid = true;
+}
+
+static int
+net_snapshot_refresh_ifaddrs(struct net_snapshot *ns)
 {
-	char syspath[IFNAMSIZ + 5] = "/net/";
 	struct ifaddrs *ifap, *ifa;
-	int ret = 0;
+	struct net_iface *ifaces;
+	size_t count = 0;
 
+	STATS_INC(backend_syscalls);
 	if (getifaddrs(&ifap) != 0)
 		return (-1);
 
+	for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next)
+		if (ifa->ifa_addr != NULL &&
+		    ifa->ifa_addr->sa_family == AF_LINK)
+			count++;
+
+	ifaces = calloc(count == 0 ? 1 : count, sizeof(struct net_iface));
+	if (ifaces == NULL) {
+		freeifaddrs(ifap);
+		return (-1);
+	}
+
+	count = 0;
 	for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
 		if (ifa->ifa_addr == NULL ||
 		    ifa->ifa_addr->sa_family != AF_LINK)
 			continue;
-		strlcpy(syspath + 5, ifa->ifa_name, IFNAMSIZ);
-		if ((ret = udev_enumerate_add_device(ue, syspath)) < 0)
+		strlcpy(ifaces[count].name, ifa->ifa_name, IFNAMSIZ);
+		net_iface_fill(&ifaces[count], ifa);
+		count++;
+	}
+	freeifaddrs(ifap);
+
+	net_snapshot_set(ns, ifaces, count);
+	return (0);
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/* Extracts interface data from RTM_NEWLINK or RTM_DELLINK message */
+static bool
+net_iface_from_nlmsg(const struct nlmsghdr *nh, struct net_iface *ni)
+{
+	const struct ifinfomsg *ifi;
+	const struct rtattr *rta;
+	size_t namelen;
+	int len;
+
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg)))
+		return (false);
+	ifi = NLMSG_DATA(nh);
+	/* Bridge port notifications duplicate generic ones */
+	if (ifi->ifi_family != AF_UNSPEC)
+		return (false);
+
+	memset(ni, 0, sizeof(*ni));
+	ni->ifindex = ifi->ifi_index;
+	len = IFLA_PAYLOAD(nh);
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			namelen = RTA_PAYLOAD(rta) < IFNAMSIZ ?
+			    RTA_PAYLOAD(rta) : IFNAMSIZ - 1;
+			memcpy(ni->name, RTA_DATA(rta), namelen);
+			ni->name[namelen] = '\0';
+			break;
+		case IFLA_ADDRESS:
+			ni->addr_len = RTA_PAYLOAD(rta);
+			if (ni->addr_len == ETHER_ADDR_LEN)
+				memcpy(ni->addr, RTA_DATA(rta), ETHER_ADDR_LEN);
 			break;
+		}
 	}
 
-	freeifaddrs(ifap);
+	return (ni->name[0] != '\0');
+}
+
+static int
+net_snapshot_refresh_netlink(struct net_snapshot *ns)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+	} req = {
+		.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg)),
+		.nh.nlmsg_type = RTM_GETLINK,
+		.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+		.nh.nlmsg_seq = 1,
+		.ifi.ifi_family = AF_UNSPEC,
+	};
+	struct net_iface *ifaces = NULL, *tmp;
+	struct nlmsghdr *nh;
+	size_t count = 0, max = 0;
+	ssize_t len;
+	char *buf;
+	int fd;
+
+	STATS_ADD(backend_syscalls, 2);
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return (-1);
+	buf = malloc(NETLINK_BUF_SIZE);
+	if (buf == NULL)
+		goto fail;
+	if (send(fd, &req, req.nh.nlmsg_len, 0) < 0)
+		goto fail;
+
+	for (;;) {
+		STATS_INC(backend_syscalls);
+		len = recv(fd, buf, NETLINK_BUF_SIZE, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			goto fail;
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_seq != req.nh.nlmsg_seq)
+				continue;
+			if (nh->nlmsg_type == NLMSG_DONE)
+				goto done;
+			if (nh->nlmsg_type == NLMSG_ERROR)
+				goto fail;
+			if (nh->nlmsg_type != RTM_NEWLINK)
+				continue;
+			if (count == max) {
+				max = max == 0 ? 64 : max * 2;
+				tmp = realloc(ifaces,
+				    max * sizeof(struct net_iface));
+				if (tmp == NULL)
+					goto fail;
+				ifaces = tmp;
+			}
+			if (net_iface_from_nlmsg(nh, &ifaces[count]))
+				count++;
+		}
+	}
+
+done:
+	if (ifaces == NULL &&
+	    (ifaces = calloc(1, sizeof(struct net_iface))) == NULL)
+		goto fail;
+	free(buf);
+	close(fd);
+	net_snapshot_set(ns, ifaces, count);
+	return (0);
+
+fail:
+	free(ifaces);
+	free(buf);
+	close(fd);
+	return (-1);
+}
+#endif /* HAVE_LINUX_RTNETLINK_H */
+
+/* Opens socket receiving interface arrivals, departures and changes */
+static int
+net_events_open(void)
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+	return (udev_net_monitor_open());
+#elif defined(HAVE_NET_ROUTE_H)
+#ifdef ROUTE_MSGFILTER
+	unsigned int filter = ROUTE_FILTER(RTM_IFINFO) |
+	    ROUTE_FILTER(RTM_IFANNOUNCE);
+#endif
+	int fd;
+
+	fd = socket(PF_ROUTE, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+	    AF_UNSPEC);
+#ifdef ROUTE_MSGFILTER
+	if (fd >= 0)
+		setsockopt(fd, PF_ROUTE, ROUTE_MSGFILTER, &filter,
+		    sizeof(filter));
+#endif
+	return (fd);
+#else
+	return (-1);
+#endif
+}
+
+/*
+ * Drains event socket. Returns true if any event or overrun was seen.
+ * Called with snapshot mutex held.
+ */
+static bool
+net_snapshot_changed(struct net_snapshot *ns)
+{
+	char buf[512];
+	ssize_t len;
+	bool changed = false;
+
+	for (;;) {
+		STATS_INC(backend_syscalls);
+		len = recv(ns->events, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == ENOBUFS) {
+			changed = true;
+			continue;
+		}
+		if (len <= 0)
+			break;
+		changed = true;
+	}
+
+	return (changed);
+}
+
+/*
+ * Drops events queued before snapshot is taken, they are reflected by it.
+ * Called with snapshot mutex held.
+ */
+static void
+net_snapshot_watch(struct net_snapshot *ns)
+{
+
+	if (!ns->watched) {
+		ns->events = net_events_open();
+		ns->watched = true;
+	}
+	if (ns->events >= 0)
+		net_snapshot_changed(ns);
+}
+
+/* Called with snapshot mutex held */
+static int
+net_snapshot_refresh(struct net_snapshot *ns)
+{
+
+	net_snapshot_watch(ns);
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+	if (net_snapshot_refresh_netlink(ns) == 0)
+		return (0);
+#endif
+	return (net_snapshot_refresh_ifaddrs(ns));
+}
+
+/*
+ * Copies interface data out of the snapshot refreshing it on miss or on
+ * pending link event. Without event socket interface index is checked.
+ */
+static bool
+net_snapshot_lookup(struct net_snapshot *ns, const char *ifname,
+    struct net_iface *ni)
+{
+	struct net_iface find, *found = NULL;
+	bool refreshed = false;
+
+	strlcpy(find.name, ifname, IFNAMSIZ);
+	pthread_mutex_lock(&ns->mtx);
+	for (;;) {
+		if (!ns->valid) {
+			if (net_snapshot_refresh(ns) != 0)
+				break;
+			refreshed = true;
+		} else if (ns->events >= 0 && net_snapshot_changed(ns)) {
+			ns->valid = false;
+			continue;
+		}
+		found = bsearch(&find, ns->ifaces, ns->count,
+		    sizeof(struct net_iface), net_iface_cmp);
+		/* Interface could be recreated since snapshot was taken */
+		if (found != NULL && (refreshed || ns->events >= 0 ||
+		    if_nametoindex(ifname) == found->ifindex))
+			break;
+		found = NULL;
+		if (refreshed)
+			break;
+		ns->valid = false;
+	}
+	if (found != NULL)
+		*ni = *found;
+	pthread_mutex_unlock(&ns->mtx);
+
+	return (found != NULL);
+}
+
+/* Checks interface presence without building udev_device */
+bool
+udev_net_exists(struct udev *udev, const char *ifname)
+{
+	struct net_iface ni;
+
+	return (net_snapshot_lookup(udev_get_net_snapshot(udev), ifname, &ni));
+}
+
+void
+net_snapshot_init(struct net_snapshot *ns)
+{
+
+	pthread_mutex_init(&ns->mtx, NULL);
+	ns->ifaces = NULL;
+	ns->count = 0;
+	ns->valid = false;
+	ns->watched = false;
+	ns->events = -1;
+}
+
+void
+net_snapshot_free(struct net_snapshot *ns)
+{
+
+	if (ns->events >= 0)
+		close(ns->events);
+	free(ns->ifaces);
+	pthread_mutex_destroy(&ns->mtx);
+}
+
+void
+net_snapshot_invalidate(struct net_snapshot *ns)
+{
+
+	pthread_mutex_lock(&ns->mtx);
+	ns->valid = false;
+	pthread_mutex_unlock(&ns->mtx);
+}
+
+/* Replaces snapshot with given interfaces. Lets udev-bench fake them */
+void
+net_snapshot_fill(struct net_snapshot *ns, const struct net_iface *ifaces,
+    size_t count)
+{
+	struct net_iface *copy;
+
+	copy = calloc(count == 0 ? 1 : count, sizeof(struct net_iface));
+	if (copy == NULL)
+		return;
+	memcpy(copy, ifaces, count * sizeof(struct net_iface));
+	pthread_mutex_lock(&ns->mtx);
+	net_snapshot_watch(ns);
+	net_snapshot_set(ns, copy, count);
+	pthread_mutex_unlock(&ns->mtx);
+}
+
+int
+udev_net_enumerate(struct udev_enumerate *ue)
+{
+	char syspath[IFNAMSIZ + 5] = "/net/";
+	struct net_snapshot *ns;
+	char (*names)[IFNAMSIZ] = NULL;
+	size_t i, count = 0;
+	int ret = 0;
+
+	ns = udev_get_net_snapshot(udev_enumerate_get_udev(ue));
+	pthread_mutex_lock(&ns->mtx);
+	ret = net_snapshot_refresh(ns);
+	if (ret == 0 && ns->count != 0) {
+		names = calloc(ns->count, IFNAMSIZ);
+		if (names == NULL)
+			ret = -1;
+		else
+			for (count = 0; count < ns->count; count++)
+				memcpy(names[count], ns->ifaces[count].name,
+				    IFNAMSIZ);
+	}
+	pthread_mutex_unlock(&ns->mtx);
+
+	/* Filters can create devices and consult the snapshot */
+	for (i = 0; ret == 0 && i < count; i++) {
+		strlcpy(syspath + 5, names[i], IFNAMSIZ);
+		ret = udev_enumerate_add_device(ue, syspath);
+	}
+	free(names);
 
 	return (ret);
 }
@@ -101,16 +502,88 @@ udev_net_monitor(char *msg, char *syspath, size_t syspathlen)
 	return (action);
 }
 
+/* Opens socket delivering link events when devd does not provide them */
+int
+udev_net_monitor_open(void)
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK,
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+	    NETLINK_ROUTE);
+	if (fd < 0)
+		return (-1);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+#else
+	return (-1);
+#endif
+}
+
+/*
+ * Reads pending link events and reports interface arrivals and departures.
+ * Other link changes only invalidate the interface snapshot.
+ */
+int
+udev_net_monitor_receive(int fd, struct udev *udev, net_event_cb_t *cb,
+    void *arg)
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+	char syspath[IFNAMSIZ + 5] = "/net/";
+	const struct ifinfomsg *ifi;
+	struct nlmsghdr *nh;
+	struct net_iface ni;
+	ssize_t len;
+	char *buf;
+
+	buf = malloc(NETLINK_BUF_SIZE);
+	if (buf == NULL)
+		return (-1);
+
+	while ((len = recv(fd, buf, NETLINK_BUF_SIZE, 0)) != 0) {
+		if (len < 0 && errno == EINTR)
+			continue;
+		/* ENOBUFS means socket overrun, some events are lost */
+		if (len < 0 && errno != ENOBUFS)
+			break;
+		/* Any link change can alter cached interface data */
+		net_snapshot_invalidate(udev_get_net_snapshot(udev));
+		if (len < 0)
+			continue;
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+			if (!net_iface_from_nlmsg(nh, &ni))
+				continue;
+			ifi = NLMSG_DATA(nh);
+			strlcpy(syspath + 5, ni.name, IFNAMSIZ);
+			if (nh->nlmsg_type == RTM_NEWLINK &&
+			    ifi->ifi_change == ~0U)
+				cb(syspath, UD_ACTION_ADD, arg);
+			else if (nh->nlmsg_type == RTM_DELLINK)
+				cb(syspath, UD_ACTION_REMOVE, arg);
+		}
+	}
+
+	free(buf);
+#endif
+	return (0);
+}
+
 void
 create_net_handler(struct udev_device *ud)
 {
 	struct udev_list *props, *attrs;
+	struct net_snapshot *ns;
+	struct net_iface ni;
 	const char *ifname;
-#ifdef HAVE_NET_IF_DL_H
-	struct ifaddrs *ifap, *ifa;
-#else
-	unsigned int ifindex;
-#endif
 
 	ifname = _udev_device_get_sysname(ud);
 	if (ifname == NULL)
@@ -121,38 +594,20 @@ create_net_handler(struct udev_device *ud)
 
 	udev_list_insert(props, "INTERFACE", ifname);
 
-#ifdef HAVE_NET_IF_DL_H
-	if (getifaddrs(&ifap) != 0)
+	ns = udev_get_net_snapshot(udev_device_get_udev(ud));
+	if (!net_snapshot_lookup(ns, ifname, &ni))
 		return;
-	for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
-		struct sockaddr_dl *foo;
-		uint8_t *lladdr;
-		if (ifa->ifa_addr == NULL ||
-		    ifa->ifa_addr->sa_family != AF_LINK)
-			continue;
-		if (strncmp(ifname, ifa->ifa_name, IFNAMSIZ) != 0)
-			continue;
-		foo = (struct sockaddr_dl *)ifa->ifa_addr;
-		if (LLINDEX(foo) != 0) {
-			udev_list_insertf(props, "IFINDEX", "%u", LLINDEX(foo));
-			udev_list_insertf(attrs, "ifindex", "%u", LLINDEX(foo));
-		}
-		udev_list_insertf(attrs, "addr_len", "%u", foo->sdl_alen);
-		if (foo->sdl_alen == ETHER_ADDR_LEN) {
-			lladdr = (uint8_t *)LLADDR(foo);
-			udev_list_insertf(attrs, "address",
-			   "%02x:%02x:%02x:%02x:%02x:%02x",
-			   lladdr[0], lladdr[1], lladdr[2],
-			   lladdr[3], lladdr[4], lladdr[5]);
-		}
-		break;
-	}
-	freeifaddrs(ifap);
-#else
-	ifindex = if_nametoindex(ifname);
-	if (ifindex != 0) {
-		udev_list_insertf(props, "IFINDEX", "%u", ifindex);
-		udev_list_insertf(attrs, "ifindex", "%u", ifindex);
+
+	if (ni.ifindex != 0) {
+		udev_list_insertf(props, "IFINDEX", "%u", ni.ifindex);
+		udev_list_insertf(attrs, "ifindex", "%u", ni.ifindex);
 	}
+#if defined(HAVE_NET_IF_DL_H) || defined(__linux__)
+	udev_list_insertf(attrs, "addr_len", "%u", ni.addr_len);
+	if (ni.addr_len == ETHER_ADDR_LEN)
+		udev_list_insertf(attrs, "address",
+		   "%02x:%02x:%02x:%02x:%02x:%02x",
+		   ni.addr[0], ni.addr[1], ni.addr[2],
+		   ni.addr[3], ni.addr[4], ni.addr[5]);
 #endif
 }
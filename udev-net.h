@@ -26,13 +26,55 @@
 #ifndef UDEV_NET_H_
 #define UDEV_NET_H_
 
+#include "config.h"
+
+#include <net/ethernet.h>
+#include <net/if.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "udev-utils.h"
 
+struct udev;
 struct udev_enumerate;
 
+typedef void (net_event_cb_t)(const char *syspath, int action, void *arg);
+
+/* Link level interface data taken from one getifaddrs() call */
+struct net_iface {
+	char name[IFNAMSIZ];
+	unsigned int ifindex;
+	unsigned int addr_len;
+	uint8_t addr[ETHER_ADDR_LEN];
+};
+
+/*
+ * Interfaces sorted by name, refreshed per scan. Pending messages on link
+ * event socket tell that snapshot may be stale.
+ */
+struct net_snapshot {
+	pthread_mutex_t mtx;
+	struct net_iface *ifaces;
+	size_t count;
+	bool valid;
+	bool watched;		/* opening event socket was tried */
+	int events;		/* link event socket, -1 if not available */
+};
+
 create_node_handler_t	create_net_handler;
 
 int udev_net_enumerate(struct udev_enumerate *ue);
 int udev_net_monitor(char *msg, char *syspath, size_t syspathlen);
+int udev_net_monitor_open(void);
+int udev_net_monitor_receive(int fd, struct udev *udev, net_event_cb_t *cb,
+    void *arg);
+bool udev_net_exists(struct udev *udev, const char *ifname);
+void net_snapshot_init(struct net_snapshot *ns);
+void net_snapshot_free(struct net_snapshot *ns);
+void net_snapshot_invalidate(struct net_snapshot *ns);
+void net_snapshot_fill(struct net_snapshot *ns, const struct net_iface *ifaces,
+    size_t count);
 
 #endif /* UDEV_NET_H_ */
@@ -32,10 +32,13 @@
 #include <sys/pciio.h>
 #endif
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #ifdef HAVE_DEVINFO_H
@@ -45,9 +48,294 @@
 #include "udev-global.h"
 
 #define _PATH_DEVPCI	"/dev/pci"
+#define	_PATH_SYSPCI	"/sys/bus/pci/devices"
+
+#define	PCI_CONF_BATCH	256
 
 #ifdef HAVE_DEVINFO_H
+static int
+pci_devpci_read(const char *path, struct pci_info **infos, size_t *count)
+{
+	struct pci_conf_io pc;
+	struct pci_conf *conf, *p;
+	struct pci_info *pi = NULL, *tmp;
+	size_t n = 0;
+	int fd;
+
+	STATS_INC(backend_syscalls);
+	fd = open(path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		ERR("Failed to open %s", path);
+		return (-1);
+	}
+
+	conf = calloc(PCI_CONF_BATCH, sizeof(struct pci_conf));
+	if (conf == NULL)
+		goto fail;
+
+restart:
+	bzero(&pc, sizeof(struct pci_conf_io));
+	pc.match_buf_len = PCI_CONF_BATCH * sizeof(struct pci_conf);
+	pc.matches = conf;
+	n = 0;
+	do {
+		STATS_INC(backend_syscalls);
+		if (ioctl(fd, PCIOCGETCONF, &pc) == -1) {
+			ERR("Failed to ioctl(PCIOCGETCONF)");
+			goto fail;
+		}
+		if (pc.status == PCI_GETCONF_LIST_CHANGED)
+			goto restart;
+		if (pc.status == PCI_GETCONF_ERROR) {
+			ERR("Bad ioctl(PCIOCGETCONF) status: %d", pc.status);
+			goto fail;
+		}
+
+		tmp = realloc(pi, (n + pc.num_matches + 1) *
+		    sizeof(struct pci_info));
+		if (tmp == NULL)
+			goto fail;
+		pi = tmp;
+		for (p = conf; p < conf + pc.num_matches; p++, n++) {
+			pi[n].domain = p->pc_sel.pc_domain;
+			pi[n].bus = p->pc_sel.pc_bus;
+			pi[n].slot = p->pc_sel.pc_dev;
+			pi[n].func = p->pc_sel.pc_func;
+			pi[n].class = p->pc_class;
+			pi[n].subclass = p->pc_subclass;
+			pi[n].progif = p->pc_progif;
+			pi[n].revid = p->pc_revid;
+			pi[n].vendor = p->pc_vendor;
+			pi[n].device = p->pc_device;
+			pi[n].subvendor = p->pc_subvendor;
+			pi[n].subdevice = p->pc_subdevice;
+		}
+	} while (pc.status == PCI_GETCONF_MORE_DEVS);
+
+	free(conf);
+	close(fd);
+	*infos = pi;
+	*count = n;
+	return (0);
+
+fail:
+	free(pi);
+	free(conf);
+	close(fd);
+	return (-1);
+}
+
+const struct pci_provider pci_provider_devpci = {
+	.path = _PATH_DEVPCI,
+	.read = pci_devpci_read,
+};
+#endif /* HAVE_DEVINFO_H */
+
+#ifdef __linux__
+static inline uint16_t
+le16_at(const uint8_t *p)
+{
+
+	return (p[0] | p[1] << 8);
+}
+
+/* Reads standard header of "config" file of every function directory */
+static int
+pci_sysfs_read(const char *path, struct pci_info **infos, size_t *count)
+{
+	struct pci_info *pi = NULL, *tmp;
+	unsigned int dom, bus, slot, func;
+	struct dirent *de;
+	char cfgpath[PATH_MAX];
+	uint8_t cfg[48];
+	size_t n = 0, max = 0;
+	int dfd, fd;
+	DIR *dir;
+
+	STATS_INC(backend_syscalls);
+	dir = opendir(path);
+	if (dir == NULL)
+		return (-1);
+	dfd = dirfd(dir);
+
+	while ((de = readdir(dir)) != NULL) {
+		if (sscanf(de->d_name, "%x:%x:%x.%x",
+		    &dom, &bus, &slot, &func) != 4)
+			continue;
+		if (n == max) {
+			max = max == 0 ? 64 : max * 2;
+			tmp = realloc(pi, max * sizeof(struct pci_info));
+			if (tmp == NULL)
+				goto fail;
+			pi = tmp;
+		}
+		if (snprintf(cfgpath, sizeof(cfgpath), "%s/config",
+		    de->d_name) >= (int)sizeof(cfgpath))
+			continue;
+		STATS_ADD(backend_syscalls, 2);
+		fd = openat(dfd, cfgpath, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		if (read(fd, cfg, sizeof(cfg)) != sizeof(cfg)) {
+			close(fd);
+			continue;
+		}
+		close(fd);
+
+		pi[n].domain = dom;
+		pi[n].bus = bus;
+		pi[n].slot = slot;
+		pi[n].func = func;
+		pi[n].vendor = le16_at(cfg + 0x00);
+		pi[n].device = le16_at(cfg + 0x02);
+		pi[n].revid = cfg[0x08];
+		pi[n].progif = cfg[0x09];
+		pi[n].subclass = cfg[0x0a];
+		pi[n].class = cfg[0x0b];
+		pi[n].subvendor = le16_at(cfg + 0x2c);
+		pi[n].subdevice = le16_at(cfg + 0x2e);
+		n++;
+	}
+
+	closedir(dir);
+	*infos = pi;
+	*count = n;
+	return (0);
+
+fail:
+	free(pi);
+	closedir(dir);
+	return (-1);
+}
+
+const struct pci_provider pci_provider_sysfs = {
+	.path = _PATH_SYSPCI,
+	.read = pci_sysfs_read,
+};
+#endif /* __linux__ */
+
+#ifdef HAVE_PCI_PROVIDER
+static int
+pci_info_cmp(const void *a, const void *b)
+{
+	const struct pci_info *pi1 = a, *pi2 = b;
+
+	if (pi1->domain != pi2->domain)
+		return (pi1->domain < pi2->domain ? -1 : 1);
+	if (pi1->bus != pi2->bus)
+		return (pi1->bus - pi2->bus);
+	if (pi1->slot != pi2->slot)
+		return (pi1->slot - pi2->slot);
+	return (pi1->func - pi2->func);
+}
+
+#endif /* HAVE_PCI_PROVIDER */
+
+void
+pci_table_init(struct pci_table *pt, const char *path)
+{
+
+	pthread_mutex_init(&pt->mtx, NULL);
+#ifdef HAVE_DEVINFO_H
+	pt->provider = &pci_provider_devpci;
+#elif defined(__linux__)
+	pt->provider = &pci_provider_sysfs;
+#else
+	pt->provider = NULL;
+#endif
+	pt->path = path != NULL && path[0] != '\0' ? strdup(path) : NULL;
+	pt->infos = NULL;
+	pt->count = 0;
+	pt->valid = false;
+}
+
+void
+pci_table_free(struct pci_table *pt)
+{
+
+	free(pt->infos);
+	free(pt->path);
+	pthread_mutex_destroy(&pt->mtx);
+}
+
+void
+pci_table_invalidate(struct pci_table *pt)
+{
+
+	pthread_mutex_lock(&pt->mtx);
+	pt->valid = false;
+	pthread_mutex_unlock(&pt->mtx);
+}
+
+#ifdef HAVE_PCI_PROVIDER
+/* Called with table mutex held */
+static int
+pci_table_refresh(struct pci_table *pt)
+{
+	struct pci_info *infos;
+	size_t count;
+
+	if (pt->provider == NULL ||
+	    pt->provider->read(pt->path != NULL ? pt->path : pt->provider->path,
+	    &infos, &count) != 0)
+		return (-1);
+
+	qsort(infos, count, sizeof(struct pci_info), pci_info_cmp);
+	free(pt->infos);
+	pt->infos = infos;
+	pt->count = count;
+	pt->valid = true;
+
+	return (0);
+}
+
+/* Copies function data out of the table refreshing it on miss */
 static bool
+pci_table_lookup(struct pci_table *pt, struct pci_info *pi)
+{
+	struct pci_info *found = NULL;
+	bool refreshed = false;
+
+	pthread_mutex_lock(&pt->mtx);
+	for (;;) {
+		if (!pt->valid) {
+			if (pci_table_refresh(pt) != 0)
+				break;
+			refreshed = true;
+		}
+		found = bsearch(pi, pt->infos, pt->count,
+		    sizeof(struct pci_info), pci_info_cmp);
+		if (found != NULL || refreshed)
+			break;
+		pt->valid = false;
+	}
+	if (found != NULL)
+		*pi = *found;
+	pthread_mutex_unlock(&pt->mtx);
+
+	return (found != NULL);
+}
+
+/* Checks presence of function named like "0000:00:1f.3" */
+bool
+udev_pci_exists(struct udev *udev, const char *dbsf)
+{
+	struct pci_info pi;
+	unsigned int dom, bus, slot, func;
+
+	if (sscanf(dbsf, "%x:%x:%x.%x", &dom, &bus, &slot, &func) != 4)
+		return (false);
+
+	pi.domain = dom;
+	pi.bus = bus;
+	pi.slot = slot;
+	pi.func = func;
+	return (pci_table_lookup(udev_get_pci_table(udev), &pi));
+}
+#endif /* HAVE_PCI_PROVIDER */
+
+/* Converts dbsf=pciD:B:S:F property of devd message to PCI sysname */
+bool
 devd2udev_dbsf(const char *msg, char *syspath, size_t syspathlen)
 {
 	const char *dbsf;
@@ -70,7 +358,9 @@ devd2udev_dbsf(const char *msg, char *syspath, size_t syspathlen)
 	return (true);
 }
 
-static int
+#ifdef HAVE_DEVINFO_H
+/* Adds PCI function to the list. Called from shared devinfo walk */
+int
 udev_pci_enumerate_cb(struct devinfo_dev *dev, void *arg)
 {
 	char syspath[DEV_PATH_MAX] = "/pci/";
@@ -83,16 +373,57 @@ udev_pci_enumerate_cb(struct devinfo_dev *dev, void *arg)
 }
 #endif
 
+#if defined(HAVE_PCI_PROVIDER) && !defined(HAVE_DEVINFO_H)
+/* Lists functions from the table where devinfo is not available */
+static int
+udev_pci_enumerate_table(struct udev_enumerate *ue, struct pci_table *pt)
+{
+	char syspath[DEV_PATH_MAX];
+	struct pci_info *infos = NULL;
+	size_t i, count = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&pt->mtx);
+	if (pt->valid && pt->count != 0) {
+		infos = calloc(pt->count, sizeof(struct pci_info));
+		if (infos != NULL) {
+			memcpy(infos, pt->infos,
+			    pt->count * sizeof(struct pci_info));
+			count = pt->count;
+		}
+	}
+	pthread_mutex_unlock(&pt->mtx);
+
+	for (i = 0; ret == 0 && i < count; i++) {
+		snprintf(syspath, sizeof(syspath), "/pci/%04x:%02x:%02x.%01x",
+		    infos[i].domain, infos[i].bus, infos[i].slot,
+		    infos[i].func);
+		ret = udev_enumerate_add_device(ue, syspath);
+	}
+	free(infos);
+
+	return (ret);
+}
+#endif
+
 int
 udev_pci_enumerate(struct udev_enumerate *ue)
 {
-#ifdef HAVE_DEVINFO_H
-	struct scandev_ctx ctx = {
-		.cb = udev_pci_enumerate_cb,
-		.args = ue,
-	};
+#ifdef HAVE_PCI_PROVIDER
+	struct pci_table *pt;
+#endif
+
+#ifdef HAVE_PCI_PROVIDER
+	/* Devices created while scanning are served from fresh table */
+	pt = udev_get_pci_table(udev_enumerate_get_udev(ue));
+	pthread_mutex_lock(&pt->mtx);
+	pt->valid = false;
+	pci_table_refresh(pt);
+	pthread_mutex_unlock(&pt->mtx);
+#endif
 
-	return (scandev_recursive(&ctx));
+#if defined(HAVE_PCI_PROVIDER) && !defined(HAVE_DEVINFO_H)
+	return (udev_pci_enumerate_table(ue, pt));
 #else
 	return (0);
 #endif
@@ -128,14 +459,12 @@ udev_pci_monitor(char *msg, char *syspath, size_t syspathlen)
 void
 create_pci_handler(struct udev_device *ud)
 {
-#ifdef HAVE_DEVINFO_H
-	struct pci_conf_io pc;
-	struct pci_conf conf;
-	struct pci_match_conf patterns;
+#ifdef HAVE_PCI_PROVIDER
+	struct pci_info pi;
 	const char *dbsf;
+	char modalias[64];
 	struct udev_list *props, *attrs;
 	unsigned int dom, bus, slot, func, class;
-	int fd;
 
 	dbsf = _udev_device_get_sysname(ud);
 	if (sscanf(dbsf, "%x:%x:%x.%x", &dom, &bus, &slot, &func) != 4) {
@@ -143,48 +472,24 @@ create_pci_handler(struct udev_device *ud)
 		return;
 	}
 
-	bzero(&pc, sizeof(struct pci_conf_io));
-	pc.match_buf_len = sizeof(conf);
-	pc.matches = &conf;
-	pc.num_patterns = 1;
-	pc.pat_buf_len = sizeof(patterns);
-	pc.patterns = &patterns;
-
-	bzero(&patterns, sizeof(patterns));
-	patterns.pc_sel.pc_domain = dom;
-	patterns.pc_sel.pc_bus = bus;
-	patterns.pc_sel.pc_dev = slot;
-	patterns.pc_sel.pc_func = func;
-	patterns.flags = PCI_GETCONF_MATCH_DOMAIN |
-	    PCI_GETCONF_MATCH_BUS | PCI_GETCONF_MATCH_DEV |
-	    PCI_GETCONF_MATCH_FUNC;
-
-	fd = open(_PATH_DEVPCI, O_RDONLY | O_CLOEXEC, 0);
-	if (fd < 0) {
-		ERR("Failed to open %s", _PATH_DEVPCI);
+	pi.domain = dom;
+	pi.bus = bus;
+	pi.slot = slot;
+	pi.func = func;
+	if (!pci_table_lookup(udev_get_pci_table(udev_device_get_udev(ud)),
+	    &pi))
 		return;
-	}
 
-	if (ioctl(fd, PCIOCGETCONF, &pc) == -1) {
-		ERR("Failed to ioctl(PCIOCGETCONF)");
-		goto out;
-	}
-
-	if (pc.status != PCI_GETCONF_LAST_DEVICE) {
-		ERR("Bad ioctl(PCIOCGETCONF) status: %d", pc.status);
-		goto out;
-	}
-
-	class = (conf.pc_class << 16)|(conf.pc_subclass << 8)|conf.pc_progif;
+	class = (pi.class << 16)|(pi.subclass << 8)|pi.progif;
 
 	props = udev_device_get_properties_list(ud);
 	attrs = udev_device_get_sysattr_list(ud);
 
 	udev_list_insertf(props, "PCI_CLASS", "%x", class);
 	udev_list_insertf(props, "PCI_ID",
-	    "%04x:%04x", conf.pc_vendor, conf.pc_device);
+	    "%04x:%04x", pi.vendor, pi.device);
 	udev_list_insertf(props, "PCI_SUBSYS_ID",
-	    "%04x:%04x", conf.pc_subvendor, conf.pc_subdevice);
+	    "%04x:%04x", pi.subvendor, pi.subdevice);
 	udev_list_insertf(props, "PCI_SLOT_NAME",
 	    "%04x:%02x:%02x.%01x", dom, bus, slot, func);
 	udev_list_insertf(props, "ID_PATH",
@@ -192,26 +497,31 @@ create_pci_handler(struct udev_device *ud)
 	udev_list_insertf(props, "ID_PATH_TAG",
 	    "pci-%04x_%02x_%02x_%01x", dom, bus, slot, func);
 
+	snprintf(modalias, sizeof(modalias),
+	    "pci:v%08Xd%08Xsv%08Xsd%08Xbc%02Xsc%02Xi%02X",
+	    pi.vendor, pi.device, pi.subvendor, pi.subdevice,
+	    pi.class, pi.subclass, pi.progif);
+	udev_list_insert(props, "MODALIAS", modalias);
+	udev_device_add_modalias(ud, "%s", modalias);
+
 	udev_list_insertf(attrs, "class", "0x%06x", class);
-	udev_list_insertf(attrs, "vendor", "0x%04x", conf.pc_vendor);
-	udev_list_insertf(attrs, "device", "0x%04x", conf.pc_device);
+	udev_list_insertf(attrs, "vendor", "0x%04x", pi.vendor);
+	udev_list_insertf(attrs, "device", "0x%04x", pi.device);
 	udev_list_insertf(attrs, "subsystem_vendor",
-	   "0x%04x", conf.pc_subvendor);
+	   "0x%04x", pi.subvendor);
 	udev_list_insertf(attrs, "subsystem_device",
-	   "0x%04x", conf.pc_subdevice);
-	udev_list_insertf(attrs, "revision", "0x%02x", conf.pc_revid);
+	   "0x%04x", pi.subdevice);
+	udev_list_insertf(attrs, "revision", "0x%02x", pi.revid);
 	udev_list_insert(attrs, "numa_node", "-1");
+	udev_list_insert(attrs, "modalias", modalias);
 	udev_list_insertf(attrs, "uevent",
 	    "PCI_CLASS=%x\n"
 	    "PCI_ID=%04x:%04x\n"
 	    "PCI_SUBSYS_ID=%04x:%04x\n"
 	    "PCI_SLOT_NAME=%04x:%02x:%02x.%01x",
 	    class,
-	    conf.pc_vendor, conf.pc_device,
-	    conf.pc_subvendor, conf.pc_subdevice,
+	    pi.vendor, pi.device,
+	    pi.subvendor, pi.subdevice,
 	    dom, bus, slot, func);
-
-out:
-	close(fd);
 #endif
 }
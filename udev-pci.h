@@ -26,11 +26,74 @@
 #ifndef UDEV_PCI_H_
 #define UDEV_PCI_H_
 
+#include "config.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "udev-utils.h"
+
 struct udev_enumerate;
 
+/* Configuration header of one PCI function */
+struct pci_info {
+	uint32_t domain;
+	uint8_t bus;
+	uint8_t slot;
+	uint8_t func;
+	uint8_t class;
+	uint8_t subclass;
+	uint8_t progif;
+	uint8_t revid;
+	uint16_t vendor;
+	uint16_t device;
+	uint16_t subvendor;
+	uint16_t subdevice;
+};
+
+/* Source of PCI configuration table. Returns all functions at once */
+struct pci_provider {
+	const char *path;	/* default node or directory */
+	int (*read)(const char *path, struct pci_info **infos, size_t *count);
+};
+
+/* PCI functions sorted by location, refreshed per scan */
+struct pci_table {
+	pthread_mutex_t mtx;
+	const struct pci_provider *provider;
+	char *path;		/* overrides provider path if set */
+	struct pci_info *infos;
+	size_t count;
+	bool valid;
+};
+
+#if defined(HAVE_DEVINFO_H) || defined(__linux__)
+#define	HAVE_PCI_PROVIDER	1
+#endif
+
+#ifdef HAVE_DEVINFO_H
+extern const struct pci_provider pci_provider_devpci;
+#endif
+#ifdef __linux__
+extern const struct pci_provider pci_provider_sysfs;
+#endif
+
 create_node_handler_t	create_pci_handler;
 
 int udev_pci_enumerate(struct udev_enumerate *ue);
+#ifdef HAVE_DEVINFO_H
+struct devinfo_dev;
+int udev_pci_enumerate_cb(struct devinfo_dev *dev, void *arg);
+#endif
 int udev_pci_monitor(char *msg, char *syspath, size_t syspathlen);
+bool devd2udev_dbsf(const char *msg, char *syspath, size_t syspathlen);
+#ifdef HAVE_PCI_PROVIDER
+bool udev_pci_exists(struct udev *udev, const char *dbsf);
+#endif
+void pci_table_init(struct pci_table *pt, const char *path);
+void pci_table_free(struct pci_table *pt);
+void pci_table_invalidate(struct pci_table *pt);
 
 #endif /* UDEV_PCI_H_ */
@@ -33,7 +33,8 @@
 #include "udev-global.h"
 
 #ifdef HAVE_DEVINFO_H
-static int
+/* Adds attached device to the list. Called from shared devinfo walk */
+int
 udev_sys_enumerate_cb(struct devinfo_dev *dev, void *arg)
 {
 	char syspath[DEV_PATH_MAX] = "/sys/";
@@ -47,21 +48,6 @@ udev_sys_enumerate_cb(struct devinfo_dev *dev, void *arg)
 }
 #endif
 
-int
-udev_sys_enumerate(struct udev_enumerate *ue)
-{
-#ifdef HAVE_DEVINFO_H
-	struct scandev_ctx ctx = {
-		.cb = udev_sys_enumerate_cb,
-		.args = ue,
-	};
-
-	return (scandev_recursive(&ctx));
-#else
-	return (0);
-#endif
-}
-
 int
 udev_sys_monitor(char *msg, char *syspath, size_t syspathlen)
 {
@@ -28,7 +28,10 @@
 
 struct udev_enumerate;
 
-int udev_sys_enumerate(struct udev_enumerate *ue);
+#ifdef HAVE_DEVINFO_H
+struct devinfo_dev;
+int udev_sys_enumerate_cb(struct devinfo_dev *dev, void *arg);
+#endif
 int udev_sys_monitor(char *msg, char *syspath, size_t syspathlen);
 
 #endif /* UDEV_SYS_H_ */
@@ -33,8 +33,10 @@
 #endif
 
 #include <assert.h>
+#include <fcntl.h>
 #include <fnmatch.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -42,11 +44,18 @@
 
 struct devnum_scan_args {
 	dev_t	devnum;
+	mode_t	type;
 	char *	pattern;
 	char *	path;
 	size_t	len;
 };
 
+struct devnum_index_entry {
+	RB_ENTRY(devnum_index_entry) link;
+	dev_t devnum;
+	char syspath[];
+};
+
 struct subsystem_config {
 	char *subsystem;
 	char *devtype;
@@ -139,7 +148,7 @@ static const struct subsystem_config subsystems[] = {
 		.create_handler = create_hidraw_handler,
 	},
 #endif
-#ifdef HAVE_DEVINFO_H
+#ifdef HAVE_PCI_PROVIDER
 	{
 		.subsystem = "pci",
 		.syspath = "/pci/*",
@@ -216,7 +225,7 @@ get_sysname_by_syspath(const char *syspath)
 const char *
 get_devpath_by_syspath(const char *syspath)
 {
-	if (strncmp(syspath, DEV_PATH_ROOT "/", 5) == 0)
+	if (syspath_is_devpath(syspath))
 		return (syspath);
 	else
 		return (strbase(syspath));
@@ -229,55 +238,113 @@ get_syspath_by_devpath(const char *devpath)
 	return (devpath);
 }
 
+/* Maps /dev path to its location in relocated device tree */
+const char *
+get_physpath_by_devpath(struct udev *udev, const char *devpath, char *buf,
+    size_t len)
+{
+	const char *root = udev_get_dev_root(udev);
+
+	if (root[0] == '\0' || !syspath_is_devpath(devpath))
+		return (devpath);
+	if ((size_t)snprintf(buf, len, "%s%s", root, devpath) >= len)
+		return (NULL);
+	return (buf);
+}
+
 static int
-get_syspath_by_devnum_cb(const char *path, mode_t type, void *args)
+get_syspath_by_devnum_cb(const char *path, int dirfd, const char *name,
+    mode_t type, void *args)
 {
 	struct devnum_scan_args *sa = args;
 	struct stat st;
 
-	if (S_ISLNK(type) &&
-	    fnmatch(sa->pattern, path, 0) == 0 &&
-	    stat(path, &st) == 0 &&
-	    st.ST_RDEV == sa->devnum) {
+	if (type != sa->type || fnmatch(sa->pattern, path, 0) != 0)
+		return (0);
+	STATS_INC(backend_syscalls);
+	if (fstatat(dirfd, name, &st, 0) == 0 && st.ST_RDEV == sa->devnum) {
 		strlcpy(sa->path, path, sa->len);
 		return (-1);
 	}
 	return (0);
 }
 
-const char *
-get_syspath_by_devnum(dev_t devnum)
+/* Kernel knows nothing of relocated tree, so it is walked instead */
+static bool
+lookup_devpath_relocated(const char *root, dev_t devnum, char *devpath,
+    size_t len)
+{
+	char path[DEV_PATH_MAX], pattern[DEV_PATH_MAX];
+	struct devnum_scan_args args = {
+		.devnum = devnum,
+		.type = S_IFCHR,
+		.pattern = pattern,
+		.path = devpath,
+		.len = len,
+	};
+	struct scandir_ctx ctx = {
+		.recursive = true,
+		.cb = get_syspath_by_devnum_cb,
+		.args = &args,
+	};
+
+	snprintf(path, sizeof(path), "%s" DEV_PATH_ROOT "/", root);
+	snprintf(pattern, sizeof(pattern), "%s" DEV_PATH_ROOT "/*", root);
+	return (scandir_recursive(path, sizeof(path), &ctx) == -1);
+}
+
+/* Works with paths inside of relocated tree, root is empty if none */
+static const char *
+lookup_syspath_by_devnum(struct udev *udev, dev_t devnum)
 {
 	char devpath[DEV_PATH_MAX] = DEV_PATH_ROOT "/";
-	char linkdir[DEV_PATH_MAX];
+	char linkdir[DEV_PATH_MAX], pattern[DEV_PATH_MAX];
+	const char *root = udev_get_dev_root(udev);
 	struct stat st;
 	struct scandir_ctx ctx;
 	struct devnum_scan_args args;
 	const char *linkbase;
-	size_t dev_len, linkdir_len, i;
-
-	dev_len = strlen(devpath);
-	devname_r(devnum, S_IFCHR, devpath + dev_len, sizeof(devpath) - dev_len);
-	/* Recheck path as devname_r returns zero-terminated garbage on error */
-	if (stat(devpath, &st) != 0 || st.ST_RDEV != devnum) {
-		TRC("(%d) -> failed", (int)devnum);
-		return NULL;
+	size_t dev_len, root_len, linkdir_len, i;
+
+	root_len = strlen(root);
+	if (root_len != 0) {
+		if (!lookup_devpath_relocated(root, devnum, devpath,
+		    sizeof(devpath))) {
+			TRC("(%d) -> failed", (int)devnum);
+			return NULL;
+		}
+	} else {
+		dev_len = strlen(devpath);
+		devname_r(devnum, S_IFCHR, devpath + dev_len,
+		    sizeof(devpath) - dev_len);
+		/*
+		 * Recheck path as devname_r returns zero-terminated garbage
+		 * on error
+		 */
+		STATS_INC(backend_syscalls);
+		if (stat(devpath, &st) != 0 || st.ST_RDEV != devnum) {
+			TRC("(%d) -> failed", (int)devnum);
+			return NULL;
+		}
 	}
 	TRC("(%d) -> %s", (int)devnum, devpath);
 
 	/* Resolve symlink in reverse direction if necessary */
 	for (i = 0; i < nitems(subsystems); i++) {
 		if (subsystems[i].symlink != NULL &&
-		    fnmatch(subsystems[i].symlink, devpath, 0) == 0) {
+		    fnmatch(subsystems[i].symlink, devpath + root_len, 0) == 0) {
 			linkbase = strbase(subsystems[i].syspath);
 			assert(linkbase != NULL);
-			linkdir_len = linkbase - subsystems[i].syspath;
+			snprintf(pattern, sizeof(pattern), "%s%s", root,
+			    subsystems[i].syspath);
+			linkdir_len = root_len + (linkbase - subsystems[i].syspath);
 			if (linkdir_len >= sizeof(linkdir))
-				linkdir_len = sizeof(linkdir);
-			strlcpy(linkdir, subsystems[i].syspath, linkdir_len + 1);
+				linkdir_len = sizeof(linkdir) - 1;
+			strlcpy(linkdir, pattern, linkdir_len + 1);
 			args = (struct devnum_scan_args) {
 				.devnum = devnum,
-				.pattern = subsystems[i].syspath,
+				.type = S_IFLNK,
+				.pattern = pattern,
 				.path = devpath,
 				.len = sizeof(devpath),
 			};
@@ -291,7 +358,255 @@ get_syspath_by_devnum(dev_t devnum)
 		}
 	}
 
-	return (strdup(devpath));
+	return (strdup(devpath + root_len));
+}
+
+/* Checks that device built from subsystems[] pattern is present */
+static bool
+syspath_exists(struct udev *udev, const char *syspath)
+{
+	char buf[DEV_PATH_MAX];
+	const char *path;
+	struct stat st;
+
+	if (syspath_is_devpath(syspath)) {
+		path = get_physpath_by_devpath(udev, syspath, buf, sizeof(buf));
+		STATS_INC(backend_syscalls);
+		return (path != NULL && stat(path, &st) == 0 &&
+		    S_ISCHR(st.st_mode));
+	}
+	if (strncmp(syspath, "/net/", 5) == 0)
+		return (udev_net_exists(udev, syspath + 5));
+#ifdef HAVE_PCI_PROVIDER
+	if (strncmp(syspath, "/pci/", 5) == 0)
+		return (udev_pci_exists(udev, syspath + 5));
+#endif
+	return (false);
+}
+
+/*
+ * Builds syspath of the device straight from subsystems[] patterns
+ * instead of scanning directories. Directory part of pattern is kept
+ * and the last component is replaced with sysname.
+ */
+bool
+get_syspath_by_subsystem_sysname(struct udev *udev, const char *subsystem,
+    const char *sysname, char *syspath, size_t len)
+{
+	const struct subsystem_config *sc;
+	const char *base;
+	size_t i, dir_len;
+
+	if (sysname[0] == '\0' || strchr(sysname, '/') != NULL)
+		return (false);
+
+	for (i = 0; i < nitems(subsystems); i++) {
+		sc = &subsystems[i];
+		if (strcmp(sc->subsystem, subsystem) != 0)
+			continue;
+		if (sc->flags & SCFLAG_SKIP_IF_EVDEV &&
+		    kernel_has_evdev_enabled())
+			continue;
+		base = strbase(sc->syspath);
+		assert(base != NULL);
+		dir_len = base - sc->syspath;
+		if (dir_len + strlen(sysname) >= len)
+			continue;
+		memcpy(syspath, sc->syspath, dir_len);
+		strlcpy(syspath + dir_len, sysname, len - dir_len);
+		if (fnmatch(sc->syspath, syspath, 0) == 0 &&
+		    syspath_exists(udev, syspath)) {
+			TRC("(%s, %s) -> %s", subsystem, sysname, syspath);
+			return (true);
+		}
+	}
+
+	TRC("(%s, %s) -> not found", subsystem, sysname);
+	return (false);
+}
+
+static int
+devnum_index_entry_cmp(struct devnum_index_entry *die1,
+    struct devnum_index_entry *die2)
+{
+
+	if (die1->devnum == die2->devnum)
+		return (0);
+	return (die1->devnum < die2->devnum ? -1 : 1);
+}
+
+RB_PROTOTYPE(devnum_index_tree, devnum_index_entry, link,
+    devnum_index_entry_cmp);
+
+void
+devnum_index_init(struct devnum_index *di)
+{
+
+	pthread_mutex_init(&di->mtx, NULL);
+	RB_INIT(&di->tree);
+	di->filled = false;
+}
+
+void
+devnum_index_free(struct devnum_index *di)
+{
+	struct devnum_index_entry *die1, *die2;
+
+	RB_FOREACH_SAFE(die1, devnum_index_tree, &di->tree, die2) {
+		RB_REMOVE(devnum_index_tree, &di->tree, die1);
+		free(die1);
+	}
+	pthread_mutex_destroy(&di->mtx);
+}
+
+/* Replaces syspath stored for devnum. Called with index mutex held */
+static void
+devnum_index_insert(struct devnum_index *di, dev_t devnum,
+    const char *syspath)
+{
+	struct devnum_index_entry *die, *old;
+	size_t len;
+
+	len = strlen(syspath);
+	die = calloc(1, offsetof(struct devnum_index_entry, syspath) + len + 1);
+	if (die == NULL)
+		return;
+	die->devnum = devnum;
+	memcpy(die->syspath, syspath, len);
+
+	old = RB_INSERT(devnum_index_tree, &di->tree, die);
+	if (old != NULL) {
+		RB_REMOVE(devnum_index_tree, &di->tree, old);
+		free(old);
+		RB_INSERT(devnum_index_tree, &di->tree, die);
+	}
+}
+
+/* Tells if device node met during walk is worth indexing */
+static bool
+devnum_index_wants(const char *syspath)
+{
+
+	return (syspath_is_devpath(syspath) &&
+	    get_subsystem_config_by_syspath(syspath) != NULL);
+}
+
+struct devnum_fill_args {
+	struct devnum_index *di;
+	size_t root_len;	/* walked path prefix not in syspath */
+};
+
+static int
+devnum_index_fill_cb(const char *path, int dirfd, const char *name,
+    mode_t type, void *arg)
+{
+	struct devnum_fill_args *args = arg;
+	const char *syspath;
+	struct stat st;
+
+	if (!S_ISLNK(type) && !S_ISCHR(type))
+		return (0);
+	syspath = get_syspath_by_devpath(path + args->root_len);
+	if (!devnum_index_wants(syspath))
+		return (0);
+
+	STATS_INC(backend_syscalls);
+	if (fstatat(dirfd, name, &st, 0) != 0 || !S_ISCHR(st.st_mode))
+		return (0);
+
+	pthread_mutex_lock(&args->di->mtx);
+	devnum_index_insert(args->di, st.ST_RDEV, syspath);
+	pthread_mutex_unlock(&args->di->mtx);
+
+	return (0);
+}
+
+/*
+ * Indexes all device nodes of known subsystems at once, so consumers
+ * resolving many device numbers do not walk device tree for each.
+ */
+static void
+devnum_index_fill(struct udev *udev, struct devnum_index *di)
+{
+	char path[DEV_PATH_MAX];
+	const char *root = udev_get_dev_root(udev);
+	struct devnum_fill_args args = {
+		.di = di,
+		.root_len = strlen(root),
+	};
+	struct scandir_ctx ctx = {
+		.recursive = true,
+		.cb = devnum_index_fill_cb,
+		.args = &args,
+	};
+
+	snprintf(path, sizeof(path), "%s" DEV_PATH_ROOT "/", root);
+	scandir_recursive(path, sizeof(path), &ctx);
+}
+
+/* Drops index entries pointing to destroyed device node */
+void
+devnum_index_forget(struct devnum_index *di, const char *syspath)
+{
+	struct devnum_index_entry *die1, *die2;
+
+	pthread_mutex_lock(&di->mtx);
+	RB_FOREACH_SAFE(die1, devnum_index_tree, &di->tree, die2) {
+		if (strcmp(die1->syspath, syspath) == 0) {
+			RB_REMOVE(devnum_index_tree, &di->tree, die1);
+			free(die1);
+		}
+	}
+	pthread_mutex_unlock(&di->mtx);
+}
+
+const char *
+get_syspath_by_devnum(struct udev *udev, dev_t devnum)
+{
+	struct devnum_index *di = udev_get_devnum_index(udev);
+	struct devnum_index_entry find, *die;
+	struct stat st;
+	char *syspath = NULL, buf[DEV_PATH_MAX];
+	const char *found, *path;
+	bool filled;
+
+	pthread_mutex_lock(&di->mtx);
+	filled = di->filled;
+	di->filled = true;
+	pthread_mutex_unlock(&di->mtx);
+	if (!filled)
+		devnum_index_fill(udev, di);
+
+	find.devnum = devnum;
+	pthread_mutex_lock(&di->mtx);
+	die = RB_FIND(devnum_index_tree, &di->tree, &find);
+	if (die != NULL)
+		syspath = strdup(die->syspath);
+	pthread_mutex_unlock(&di->mtx);
+
+	/* Node may be recreated with other number since it was indexed */
+	if (syspath != NULL) {
+		path = get_physpath_by_devpath(udev, syspath, buf, sizeof(buf));
+		STATS_INC(backend_syscalls);
+		if (path != NULL && stat(path, &st) == 0 &&
+		    st.ST_RDEV == devnum) {
+			TRC("(%d) -> %s (cached)", (int)devnum, syspath);
+			return (syspath);
+		}
+		free(syspath);
+	}
+
+	found = lookup_syspath_by_devnum(udev, devnum);
+	pthread_mutex_lock(&di->mtx);
+	if (found != NULL)
+		devnum_index_insert(di, devnum, found);
+	else if ((die = RB_FIND(devnum_index_tree, &di->tree, &find)) != NULL) {
+		RB_REMOVE(devnum_index_tree, &di->tree, die);
+		free(die);
+	}
+	pthread_mutex_unlock(&di->mtx);
+
+	return (found);
 }
 
 void
@@ -299,6 +614,8 @@ invoke_create_handler(struct udev_device *ud)
 {
 	const char *path;
 	const struct subsystem_config *sc;
+	uint64_t elapsed, start;
+	int idx;
 
 	path = _udev_device_get_syspath(ud);
 	sc = get_subsystem_config_by_syspath(path);
@@ -309,7 +626,18 @@ invoke_create_handler(struct udev_device *ud)
 		return;
 	}
 
+	idx = udev_stats_subsystem(sc->subsystem);
+	start = udev_stats_now();
+	TRACE(TRACE_HANDLER_START, path);
+	PROBE2(handler__start, sc->subsystem, path);
 	sc->create_handler(ud);
+	PROBE2(handler__end, sc->subsystem, path);
+	TRACE(TRACE_HANDLER_END, path);
+	elapsed = udev_stats_now() - start;
+	STATS_INC(handler_calls[idx]);
+	STATS_ADD(handler_ns[idx], elapsed);
+	if (__atomic_load_n(&udev_enumerate_profiled, __ATOMIC_RELAXED) != 0)
+		udev_enumerate_profile_handler(ud, idx, elapsed);
 }
 
 size_t
@@ -334,3 +662,6 @@ udev_util_encode_string(const char *str, char *str_enc, size_t len)
 	return (strlcpy(str_enc, str, len) < len ? 0 : -EINVAL);
 #endif
 }
+
+RB_GENERATE(devnum_index_tree, devnum_index_entry, link,
+    devnum_index_entry_cmp);
@@ -26,6 +26,13 @@
 #ifndef UDEV_UTILS_H_
 #define UDEV_UTILS_H_
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "utils.h"
+
+struct udev;
 struct udev_device;
 
 #define	LIBUDEV_EXPORT	__attribute__((visibility("default")))
@@ -44,11 +51,37 @@ struct udev_device;
 
 typedef void (create_node_handler_t)(struct udev_device *udev_device);
 
+/*
+ * Device number to syspath index of known device nodes. It is filled with
+ * one walk of device tree on first lookup and updated on later misses.
+ */
+RB_HEAD(devnum_index_tree, devnum_index_entry);
+struct devnum_index {
+	pthread_mutex_t mtx;
+	struct devnum_index_tree tree;
+	bool filled;
+};
+
+/* Tells if syspath is a device node path, i.e. starts with "/dev/" */
+static inline bool
+syspath_is_devpath(const char *syspath)
+{
+
+	return (strncmp(syspath, DEV_PATH_ROOT "/", sizeof(DEV_PATH_ROOT)) == 0);
+}
+
 const char *get_subsystem_by_syspath(const char *syspath, const char **devtype);
 const char *get_sysname_by_syspath(const char *syspath);
 const char *get_devpath_by_syspath(const char *syspath);
 const char *get_syspath_by_devpath(const char *devpath);
-const char *get_syspath_by_devnum(dev_t devnum);
+const char *get_physpath_by_devpath(struct udev *udev, const char *devpath,
+    char *buf, size_t len);
+const char *get_syspath_by_devnum(struct udev *udev, dev_t devnum);
+bool get_syspath_by_subsystem_sysname(struct udev *udev,
+    const char *subsystem, const char *sysname, char *syspath, size_t len);
+void devnum_index_init(struct devnum_index *di);
+void devnum_index_free(struct devnum_index *di);
+void devnum_index_forget(struct devnum_index *di, const char *syspath);
 
 void invoke_create_handler(struct udev_device *ud);
 size_t syspathlen_wo_units(const char *path);
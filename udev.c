@@ -23,16 +23,273 @@
  * SUCH DAMAGE.
  */
 
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 #include "udev-global.h"
 
+typedef void (udev_log_fn_t)(struct udev *udev, int priority,
+    const char *file, int line, const char *fn, const char *format,
+    va_list args);
+
 struct udev {
 	int refcount;
 	void *userdata;
+	udev_log_fn_t *log_fn;
+	int log_priority;
+	int log_busy;		/* log function calls in progress */
+	bool log_closed;	/* context is being destroyed */
+	bool log_dead;		/* freed by last log function call */
+	STAILQ_ENTRY(udev) log_link;
+	struct parent_cache parent_cache;
+	struct udev_device_cache device_cache;
+	struct udev_hwdb_cache hwdb_cache;
+	struct net_snapshot net_snapshot;
+	struct pci_table pci_table;
+	struct devnum_index devnum_index;
+	char *dev_root;		/* prefix of relocated device tree */
+	char *dev_path;
+	char *devd_socket;
+};
+
+/* Contexts receiving log messages, those with non-zero priority */
+static STAILQ_HEAD(, udev) udev_log_list =
+    STAILQ_HEAD_INITIALIZER(udev_log_list);
+static pthread_mutex_t udev_log_mtx = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool udev_log_active = false;
+int udev_log_priority_max = 0;
+
+/* Log functions called by one message, taken from udev_log_list */
+#define	UDEV_LOG_TARGETS	16
+
+struct udev_log_target {
+	struct udev *udev;
+	udev_log_fn_t *log_fn;
 };
 
+static void
+udev_log_stderr(struct udev *udev, int priority, const char *file, int line,
+    const char *fn, const char *format, va_list args)
+{
+
+	vfprintf(stderr, format, args);
+}
+
+/* Parses UDEV_LOG value: syslog priority number or its name */
+static int
+udev_log_priority_from_env(void)
+{
+	const char *env;
+	char *end;
+	long prio;
+
+	env = secure_getenv("UDEV_LOG");
+	if (env == NULL || env[0] == '\0')
+		return (0);
+
+	prio = strtol(env, &end, 10);
+	if (*end == '\0' && prio >= 0 && prio <= LOG_DEBUG)
+		return (prio);
+	if (strcasecmp(env, "err") == 0)
+		return (LOG_ERR);
+	if (strcasecmp(env, "info") == 0)
+		return (LOG_INFO);
+	if (strcasecmp(env, "debug") == 0)
+		return (LOG_DEBUG);
+	return (0);
+}
+
+/* Called with udev_log_mtx held */
+static void
+udev_log_update_max(void)
+{
+	struct udev *udev;
+	int max = 0;
+
+	STAILQ_FOREACH(udev, &udev_log_list, log_link)
+		if (udev->log_priority > max)
+			max = udev->log_priority;
+	__atomic_store_n(&udev_log_priority_max, max, __ATOMIC_RELAXED);
+}
+
+static void
+udev_log_register(struct udev *udev, int priority)
+{
+
+	pthread_mutex_lock(&udev_log_mtx);
+	/* Log function may still reconfigure context being destroyed */
+	if (udev->log_closed)
+		priority = 0;
+	if (udev->log_priority > 0)
+		STAILQ_REMOVE(&udev_log_list, udev, udev, log_link);
+	udev->log_priority = priority;
+	if (udev->log_priority > 0)
+		STAILQ_INSERT_TAIL(&udev_log_list, udev, log_link);
+	udev_log_update_max();
+	pthread_mutex_unlock(&udev_log_mtx);
+}
+
+/* Stops passing messages to context being destroyed */
+static void
+udev_log_close(struct udev *udev)
+{
+
+	pthread_mutex_lock(&udev_log_mtx);
+	udev->log_closed = true;
+	pthread_mutex_unlock(&udev_log_mtx);
+	udev_log_register(udev, 0);
+}
+
+/*
+ * Frees context unless its log function is running. Then the last such
+ * call frees it, so log function may release its own context.
+ */
+static void
+udev_log_release(struct udev *udev)
+{
+	bool busy;
+
+	pthread_mutex_lock(&udev_log_mtx);
+	busy = udev->log_busy > 0;
+	udev->log_dead = busy;
+	pthread_mutex_unlock(&udev_log_mtx);
+
+	if (!busy)
+		free(udev);
+}
+
+/*
+ * Most of the library does not know the context it works for, so message
+ * goes to every context with high enough priority. Log functions are
+ * called without udev_log_mtx held, so they may create, release or
+ * reconfigure contexts. Messages logged from inside of log function are
+ * dropped.
+ */
+void
+udev_log(int priority, const char *file, int line, const char *fn,
+    const char *format, ...)
+{
+	char buf[512];
+	struct udev_log_target stack_targets[UDEV_LOG_TARGETS], *targets;
+	struct udev *udev;
+	va_list ap;
+	int saved_errno = errno;
+	int i, cnt, ntargets = 0;
+	bool stderr_done = false, dead;
+
+	if (udev_log_active)
+		return;
+	udev_log_active = true;
+
+	/* Errors are suffixed with errno description like before */
+	if (priority <= LOG_ERR && saved_errno != 0) {
+		snprintf(buf, sizeof(buf), "%s %d(%s)\n", format,
+		    saved_errno, strerror(saved_errno));
+		format = buf;
+	} else {
+		snprintf(buf, sizeof(buf), "%s\n", format);
+		format = buf;
+	}
+
+	pthread_mutex_lock(&udev_log_mtx);
+	cnt = 0;
+	STAILQ_FOREACH(udev, &udev_log_list, log_link)
+		cnt++;
+	targets = stack_targets;
+	if (cnt > UDEV_LOG_TARGETS) {
+		targets = calloc(cnt, sizeof(struct udev_log_target));
+		if (targets == NULL) {
+			targets = stack_targets;
+			cnt = UDEV_LOG_TARGETS;
+		}
+	}
+	STAILQ_FOREACH(udev, &udev_log_list, log_link) {
+		if (ntargets == cnt)
+			break;
+		if (udev->log_priority < priority)
+			continue;
+		if (udev->log_fn == udev_log_stderr) {
+			if (stderr_done)
+				continue;
+			stderr_done = true;
+		}
+		udev->log_busy++;
+		targets[ntargets].udev = udev;
+		targets[ntargets].log_fn = udev->log_fn;
+		ntargets++;
+	}
+	pthread_mutex_unlock(&udev_log_mtx);
+
+	for (i = 0; i < ntargets; i++) {
+		va_start(ap, format);
+		errno = saved_errno;
+		targets[i].log_fn(targets[i].udev, priority, file, line, fn,
+		    format, ap);
+		va_end(ap);
+
+		udev = targets[i].udev;
+		pthread_mutex_lock(&udev_log_mtx);
+		dead = --udev->log_busy == 0 && udev->log_dead;
+		pthread_mutex_unlock(&udev_log_mtx);
+		if (dead)
+			free(udev);
+	}
+	if (targets != stack_targets)
+		free(targets);
+
+	udev_log_active = false;
+	errno = saved_errno;
+}
+
+/*
+ * Takes paths of relocated device tree from environment. Test aid. Socket
+ * path which does not fit sockaddr_un is an error rather than being
+ * truncated to some other path.
+ */
+static int
+udev_paths_init(struct udev *udev)
+{
+	const char *env;
+	size_t len;
+
+	env = secure_getenv("UDEV_DEV_ROOT");
+	if (env != NULL && (len = strlen(env)) > 0) {
+		while (len > 1 && env[len - 1] == '/')
+			len--;
+		udev->dev_root = strndup(env, len);
+		if (udev->dev_root != NULL &&
+		    asprintf(&udev->dev_path, "%s" DEV_PATH_ROOT,
+		    udev->dev_root) < 0) {
+			free(udev->dev_root);
+			udev->dev_root = NULL;
+			udev->dev_path = NULL;
+		}
+	}
+
+	env = secure_getenv("UDEV_DEVD_SOCKET");
+	if (env != NULL && env[0] != '\0') {
+		if (strlen(env) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+			errno = ENAMETOOLONG;
+			ERR("UDEV_DEVD_SOCKET %s is too long", env);
+			return (-1);
+		}
+		udev->devd_socket = strdup(env);
+	}
+
+	return (0);
+}
+
 LIBUDEV_EXPORT struct udev *
 udev_new(void)
 {
@@ -43,6 +300,20 @@ udev_new(void)
 	if (udev) {
 		udev->refcount = 1;
 		udev->userdata = NULL;
+		udev->log_fn = udev_log_stderr;
+		udev_log_register(udev, udev_log_priority_from_env());
+		parent_cache_init(&udev->parent_cache);
+		udev_device_cache_init(&udev->device_cache);
+		udev_hwdb_cache_init(&udev->hwdb_cache);
+		net_snapshot_init(&udev->net_snapshot);
+		pci_table_init(&udev->pci_table,
+		    secure_getenv("UDEV_PCI_PATH"));
+		devnum_index_init(&udev->devnum_index);
+		if (udev_paths_init(udev) != 0) {
+			_udev_unref(udev);
+			errno = ENAMETOOLONG;
+			return (NULL);
+		}
 	}
 
 	return (udev);
@@ -68,8 +339,19 @@ void
 _udev_unref(struct udev *udev)
 {
 
-	if (--udev->refcount == 0)
-		free(udev);
+	if (--udev->refcount == 0) {
+		udev_log_close(udev);
+		parent_cache_free(&udev->parent_cache);
+		udev_device_cache_free(&udev->device_cache);
+		udev_hwdb_cache_free(&udev->hwdb_cache);
+		net_snapshot_free(&udev->net_snapshot);
+		pci_table_free(&udev->pci_table);
+		devnum_index_free(&udev->devnum_index);
+		free(udev->dev_root);
+		free(udev->dev_path);
+		free(udev->devd_socket);
+		udev_log_release(udev);
+	}
 }
 
 LIBUDEV_EXPORT void
@@ -80,12 +362,70 @@ udev_unref(struct udev *udev)
 	_udev_unref(udev);
 }
 
+struct parent_cache *
+udev_get_parent_cache(struct udev *udev)
+{
+
+	return (&udev->parent_cache);
+}
+
+struct udev_device_cache *
+udev_get_device_cache(struct udev *udev)
+{
+
+	return (&udev->device_cache);
+}
+
+struct udev_hwdb_cache *
+udev_get_hwdb_cache(struct udev *udev)
+{
+
+	return (&udev->hwdb_cache);
+}
+
+struct net_snapshot *
+udev_get_net_snapshot(struct udev *udev)
+{
+
+	return (&udev->net_snapshot);
+}
+
+struct pci_table *
+udev_get_pci_table(struct udev *udev)
+{
+
+	return (&udev->pci_table);
+}
+
+struct devnum_index *
+udev_get_devnum_index(struct udev *udev)
+{
+
+	return (&udev->devnum_index);
+}
+
+/* Returns prefix of device tree or empty string if it is not relocated */
+const char *
+udev_get_dev_root(struct udev *udev)
+{
+
+	return (udev->dev_root != NULL ? udev->dev_root : "");
+}
+
+/* Returns devd socket path or NULL for default one */
+const char *
+udev_get_devd_socket(struct udev *udev)
+{
+
+	return (udev->devd_socket);
+}
+
 LIBUDEV_EXPORT const char *
 udev_get_dev_path(struct udev *udev)
 {
 
 	TRC();
-	return (DEV_PATH_ROOT);
+	return (udev->dev_path != NULL ? udev->dev_path : DEV_PATH_ROOT);
 }
 
 LIBUDEV_EXPORT void *
@@ -109,18 +449,29 @@ udev_set_log_fn(struct udev *udev, void (*log_fn)(struct udev *udev,
     int priority, const char *file, int line, const char *fn,
     const char *format, va_list args))
 {
-	UNIMPL();
+
+	TRC("(%p)", udev);
+	pthread_mutex_lock(&udev_log_mtx);
+	udev->log_fn = log_fn != NULL ? log_fn : udev_log_stderr;
+	pthread_mutex_unlock(&udev_log_mtx);
 }
 
 LIBUDEV_EXPORT void
 udev_set_log_priority(struct udev *udev, int priority)
 {
-	UNIMPL();
+
+	TRC("(%p, %d)", udev, priority);
+	if (priority < 0)
+		priority = 0;
+	if (priority > LOG_DEBUG)
+		priority = LOG_DEBUG;
+	udev_log_register(udev, priority);
 }
 
 LIBUDEV_EXPORT int
 udev_get_log_priority(struct udev *udev)
 {
-	UNIMPL();
-	return (0);
+
+	TRC("(%p)", udev);
+	return (udev->log_priority);
 }
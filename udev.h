@@ -30,5 +30,13 @@
 
 struct udev *_udev_ref(struct udev *udev);
 void _udev_unref(struct udev *udev);
+struct parent_cache *udev_get_parent_cache(struct udev *udev);
+struct udev_device_cache *udev_get_device_cache(struct udev *udev);
+struct udev_hwdb_cache *udev_get_hwdb_cache(struct udev *udev);
+struct net_snapshot *udev_get_net_snapshot(struct udev *udev);
+struct pci_table *udev_get_pci_table(struct udev *udev);
+struct devnum_index *udev_get_devnum_index(struct udev *udev);
+const char *udev_get_dev_root(struct udev *udev);
+const char *udev_get_devd_socket(struct udev *udev);
 
 #endif /* UDEV_H_ */
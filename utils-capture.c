@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "utils-capture.h"
+
+#define	CAPTURE_BYTEORDER	0x01020304
+
+/*
+ * Opens capture for appending. Header is written to empty file only, under
+ * lock so concurrent openers do not both write it. Sets errno on failure.
+ */
+int
+capture_open(const char *path)
+{
+	struct capture_header hdr = {
+		.magic = CAPTURE_MAGIC,
+		.version = CAPTURE_VERSION,
+		.byteorder = CAPTURE_BYTEORDER,
+	};
+	struct stat st;
+	ssize_t len = sizeof(hdr);
+	int error, fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		error = errno;
+		ERR("Failed to open capture %s", path);
+		errno = error;
+		return (-1);
+	}
+	if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0 ||
+	    (st.st_size == 0 && (len = write(fd, &hdr, sizeof(hdr))) !=
+	    sizeof(hdr))) {
+		/* Short write leaves errno alone */
+		error = len >= 0 ? EIO : errno;
+		ERR("Failed to write capture header");
+		close(fd);
+		errno = error;
+		return (-1);
+	}
+	flock(fd, LOCK_UN);
+
+	return (fd);
+}
+
+/* Record goes with single write so monitors may share capture file */
+int
+capture_write(int fd, uint64_t ts, const char *line, size_t line_len,
+    int action, const char *syspath)
+{
+	struct capture_record rec;
+	struct iovec iov[3];
+	size_t syspath_len;
+
+	syspath_len = syspath != NULL ? strlen(syspath) : 0;
+	if (line_len > UINT16_MAX || syspath_len > UINT16_MAX)
+		return (-1);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.ts = ts;
+	rec.line_len = line_len;
+	rec.syspath_len = syspath_len;
+	rec.action = action;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *)line;
+	iov[1].iov_len = line_len;
+	iov[2].iov_base = (void *)syspath;
+	iov[2].iov_len = syspath_len;
+
+	if (writev(fd, iov, nitems(iov)) !=
+	    (ssize_t)(sizeof(rec) + line_len + syspath_len))
+		return (-1);
+
+	return (0);
+}
+
+FILE *
+capture_open_read(const char *path)
+{
+	struct capture_header hdr;
+	FILE *fp;
+
+	fp = fopen(path, "re");
+	if (fp == NULL) {
+		ERR("Failed to open capture %s", path);
+		return (NULL);
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+	    hdr.version != CAPTURE_VERSION ||
+	    hdr.byteorder != CAPTURE_BYTEORDER) {
+		errno = EINVAL;
+		ERR("%s is not a capture of this host", path);
+		fclose(fp);
+		return (NULL);
+	}
+
+	return (fp);
+}
+
+/*
+ * Reads next record. Line and syspath are NUL-terminated. Returns 1 on
+ * success, 0 at end of file and -1 on error.
+ */
+int
+capture_read(FILE *fp, struct capture_record *rec, char *line,
+    size_t line_size, char *syspath, size_t syspath_size)
+{
+
+	if (fread(rec, sizeof(*rec), 1, fp) != 1)
+		return (feof(fp) ? 0 : -1);
+	if (rec->line_len >= line_size || rec->syspath_len >= syspath_size)
+		return (-1);
+	if (fread(line, 1, rec->line_len, fp) != rec->line_len ||
+	    fread(syspath, 1, rec->syspath_len, fp) != rec->syspath_len)
+		return (-1);
+	line[rec->line_len] = '\0';
+	syspath[rec->syspath_len] = '\0';
+
+	return (1);
+}
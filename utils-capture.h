@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef UTILS_CAPTURE_H_
+#define UTILS_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Capture file of devd events received by monitors. File starts with
+ * header followed by records, each one is immediately followed by raw devd
+ * line and resulting syspath, both without terminating NUL. Integers are
+ * stored in host byte order.
+ */
+#define	CAPTURE_MAGIC		"UDEVCAP"
+#define	CAPTURE_VERSION		1
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;	/* 0x01020304 as written by host */
+};
+
+struct capture_record {
+	uint64_t ts;		/* CLOCK_MONOTONIC, ns */
+	uint16_t line_len;
+	uint16_t syspath_len;
+	uint8_t action;		/* UD_ACTION_* */
+	uint8_t pad[3];
+};
+
+int capture_open(const char *path);
+int capture_write(int fd, uint64_t ts, const char *line, size_t line_len,
+    int action, const char *syspath);
+FILE *capture_open_read(const char *path);
+int capture_read(FILE *fp, struct capture_record *rec, char *line,
+    size_t line_size, char *syspath, size_t syspath_size);
+
+#endif /* UTILS_CAPTURE_H_ */
@@ -371,7 +371,8 @@ int encode_devnode_name(const char *str, char *str_enc, size_t len) {
 
                 } else if (str[i] == '\\' || !whitelisted_char_for_devnode(str[i], NULL)) {
 
-                        if (len-j < 4)
+                        /* sprintf() writes terminating NUL too */
+                        if (len-j < 5)
                                 return -EINVAL;
 
                         sprintf(&str_enc[j], "\\x%02x", (unsigned char) str[i]);
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef UTILS_PROBE_H_
+#define UTILS_PROBE_H_
+
+/*
+ * Static probes of "libudev" provider for dtrace/bpftrace. Compiled to
+ * nothing unless configured with SDT support. Systemtap-style sys/sdt.h
+ * places probes in ELF notes. Otherwise probes are declared by header
+ * which dtrace -h generates from libudev_provider.d and are resolved by
+ * dtrace -G at link time.
+ *
+ * devd__receive(msg)			devd message is read
+ * monitor__parse(backend, action, syspath)	backend parsed message
+ * filter__match(syspath), filter__reject(syspath)
+ * handler__start(subsystem, syspath), handler__end(subsystem, syspath)
+ * queue__enqueue(syspath, action), queue__dequeue(syspath)
+ * enumerate__start(backend), enumerate__end(backend, ret)
+ */
+#if defined(ENABLE_SDT) && defined(ENABLE_DTRACE_PROVIDER)
+#include "libudev_provider.h"
+
+#define	PROBE1(name, a)		__dtrace_libudev___##name(a)
+#define	PROBE2(name, a, b)	__dtrace_libudev___##name(a, b)
+#define	PROBE3(name, a, b, c)	__dtrace_libudev___##name(a, b, c)
+#elif defined(ENABLE_SDT)
+#include <sys/sdt.h>
+
+#define	PROBE1(name, a)		DTRACE_PROBE1(libudev, name, a)
+#define	PROBE2(name, a, b)	DTRACE_PROBE2(libudev, name, a, b)
+#define	PROBE3(name, a, b, c)	DTRACE_PROBE3(libudev, name, a, b, c)
+#else
+#define	PROBE1(name, a)		do { } while (0)
+#define	PROBE2(name, a, b)	do { } while (0)
+#define	PROBE3(name, a, b, c)	do { } while (0)
+#endif
+
+#endif /* UTILS_PROBE_H_ */
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "udev-global.h"
+
+struct udev_stats udev_stats_counters;
+
+static const char * const stats_subsystems[UDEV_STATS_SUBSYSTEM_CNT] = {
+	[UDEV_STATS_OTHER] = "other",
+	[UDEV_STATS_INPUT] = "input",
+	[UDEV_STATS_DRM] = "drm",
+	[UDEV_STATS_NET] = "net",
+	[UDEV_STATS_HIDRAW] = "hidraw",
+	[UDEV_STATS_PCI] = "pci",
+};
+
+_Static_assert(UDEV_STATS_SUBSYSTEM_CNT <= UDEV_STATS_SUBSYSTEM_MAX,
+    "too many stats subsystems");
+
+/* Maps subsystem name to index of per-subsystem counters */
+int
+udev_stats_subsystem(const char *subsystem)
+{
+	int i;
+
+	for (i = UDEV_STATS_OTHER + 1; i < UDEV_STATS_SUBSYSTEM_CNT; i++)
+		if (strcmp(stats_subsystems[i], subsystem) == 0)
+			return (i);
+
+	return (UDEV_STATS_OTHER);
+}
+
+const char *
+udev_stats_subsystem_name(int idx)
+{
+
+	if (idx < 0 || idx >= UDEV_STATS_SUBSYSTEM_CNT)
+		idx = UDEV_STATS_OTHER;
+	return (stats_subsystems[idx]);
+}
+
+/* Accounts time since start_ns in log2 histogram bucket */
+void
+udev_stats_latency(uint64_t start_ns)
+{
+	uint64_t delta;
+	int bucket;
+
+	delta = udev_stats_now() - start_ns;
+	bucket = delta == 0 ? 0 : 63 - __builtin_clzll(delta);
+	if (bucket >= UDEV_STATS_LATENCY_BUCKETS)
+		bucket = UDEV_STATS_LATENCY_BUCKETS - 1;
+	STATS_INC(latency[bucket]);
+}
+
+/*
+ * Copies counters out. size is sizeof(struct udev_stats) the caller was
+ * built with, so structure can grow at the end.
+ */
+LIBUDEV_EXPORT int
+udev_get_stats(struct udev_stats *stats, size_t size)
+{
+	unsigned long long *dst, *src;
+	size_t i;
+
+	if (stats == NULL)
+		return (-EINVAL);
+	if (size > sizeof(struct udev_stats))
+		size = sizeof(struct udev_stats);
+
+	dst = (unsigned long long *)stats;
+	src = (unsigned long long *)&udev_stats_counters;
+	for (i = 0; i < size / sizeof(unsigned long long); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+	return (0);
+}
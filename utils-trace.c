@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * In-memory trace of hot path events. Every thread writes to its own
+ * ring, so recording takes neither locks nor atomic read-modify-write
+ * operations. Rings are linked into a global list and reused after
+ * their threads exit. Dump may race with writers and catch a record
+ * being overwritten, which is accepted for a trace.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "udev-global.h"
+
+#define	TRACE_RING_SIZE	4096	/* records, power of 2 */
+
+struct trace_ring {
+	struct trace_ring *next;
+	int busy;		/* owned by live thread */
+	int id;
+	uint64_t head;		/* total number of records written */
+	struct trace_record recs[TRACE_RING_SIZE];
+};
+
+static const char * const trace_event_names[TRACE_EVENT_CNT] = {
+	[TRACE_DEVD_RECV] = "devd-recv",
+	[TRACE_DEVD_PARSE] = "devd-parse",
+	[TRACE_FILTER_MATCH] = "filter-match",
+	[TRACE_FILTER_REJECT] = "filter-reject",
+	[TRACE_HANDLER_START] = "handler-start",
+	[TRACE_HANDLER_END] = "handler-end",
+	[TRACE_QUEUE_PUSH] = "queue-push",
+	[TRACE_QUEUE_POP] = "queue-pop",
+};
+
+bool udev_trace_enabled = false;
+static struct trace_ring *trace_rings = NULL;
+static int trace_ring_cnt = 0;
+static __thread struct trace_ring *trace_ring = NULL;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static void
+trace_ring_release(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	__atomic_store_n(&ring->busy, 0, __ATOMIC_RELEASE);
+}
+
+static void
+trace_key_init(void)
+{
+
+	pthread_key_create(&trace_key, trace_ring_release);
+}
+
+/* Takes ring left by exited thread or links new one into the list */
+static struct trace_ring *
+trace_ring_acquire(void)
+{
+	struct trace_ring *ring;
+	int idle = 0;
+
+	pthread_once(&trace_once, trace_key_init);
+
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+	    ring != NULL; ring = ring->next)
+		if (__atomic_compare_exchange_n(&ring->busy, &idle, 1, false,
+		    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+		else
+			idle = 0;
+
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(struct trace_ring));
+		if (ring == NULL)
+			return (NULL);
+		ring->busy = 1;
+		ring->id = __atomic_add_fetch(&trace_ring_cnt, 1,
+		    __ATOMIC_RELAXED);
+		ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&trace_rings, &ring->next,
+		    ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	pthread_setspecific(trace_key, ring);
+	return (ring);
+}
+
+static uint32_t
+trace_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	if (str == NULL)
+		return (0);
+	while (*str != '\0')
+		hash = (hash ^ (unsigned char)*str++) * 16777619u;
+
+	return (hash);
+}
+
+void
+udev_trace_record(uint32_t event, const char *syspath)
+{
+	struct trace_ring *ring = trace_ring;
+	struct trace_record *rec;
+	struct timespec ts;
+
+	if (ring == NULL) {
+		ring = trace_ring = trace_ring_acquire();
+		if (ring == NULL)
+			return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec = &ring->recs[ring->head & (TRACE_RING_SIZE - 1)];
+	rec->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rec->event = event;
+	rec->hash = trace_hash(syspath);
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Appends unsigned number to buffer. Async-signal-safe */
+static char *
+trace_fmt_num(char *p, uint64_t num, int base, int width)
+{
+	char tmp[24];
+	int i = 0;
+
+	do {
+		tmp[i++] = "0123456789abcdef"[num % base];
+		num /= base;
+	} while (num != 0);
+	while (i < width)
+		tmp[i++] = '0';
+	while (i > 0)
+		*p++ = tmp[--i];
+
+	return (p);
+}
+
+/*
+ * Writes all rings to fd as text lines "ring timestamp event hash".
+ * Uses only write(2), so it is safe to call from a signal handler.
+ */
+LIBUDEV_EXPORT int
+udev_trace_dump(int fd)
+{
+	char line[96], *p;
+	const char *name;
+	struct trace_ring *ring;
+	struct trace_record rec;
+	uint64_t head, i;
+
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+	    ring != NULL; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		for (; i < head; i++) {
+			rec = ring->recs[i & (TRACE_RING_SIZE - 1)];
+			if (rec.event >= TRACE_EVENT_CNT)
+				continue;
+			p = trace_fmt_num(line, ring->id, 10, 0);
+			*p++ = ' ';
+			p = trace_fmt_num(p, rec.ts / 1000000000, 10, 0);
+			*p++ = '.';
+			p = trace_fmt_num(p, rec.ts % 1000000000, 10, 9);
+			*p++ = ' ';
+			for (name = trace_event_names[rec.event]; *name; )
+				*p++ = *name++;
+			*p++ = ' ';
+			p = trace_fmt_num(p, rec.hash, 16, 8);
+			*p++ = '\n';
+			if (write(fd, line, p - line) < 0)
+				return (-1);
+		}
+	}
+
+	return (0);
+}
+
+LIBUDEV_EXPORT void
+udev_trace_enable(int enable)
+{
+
+	__atomic_store_n(&udev_trace_enabled, enable != 0, __ATOMIC_RELAXED);
+}
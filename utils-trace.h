@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2021 Vladimir Kondratyev <vladimir@kondratyev.su>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef UTILS_TRACE_H_
+#define UTILS_TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+	TRACE_DEVD_RECV,
+	TRACE_DEVD_PARSE,
+	TRACE_FILTER_MATCH,
+	TRACE_FILTER_REJECT,
+	TRACE_HANDLER_START,
+	TRACE_HANDLER_END,
+	TRACE_QUEUE_PUSH,
+	TRACE_QUEUE_POP,
+	TRACE_EVENT_CNT,
+};
+
+/* One binary trace record. Syspath is stored as its hash */
+struct trace_record {
+	uint64_t ts;		/* CLOCK_MONOTONIC, ns */
+	uint32_t event;
+	uint32_t hash;
+};
+
+extern bool udev_trace_enabled;
+
+void udev_trace_record(uint32_t event, const char *syspath);
+
+#define	TRACE(event, syspath) do {					\
+	if (__builtin_expect(udev_trace_enabled, 0))			\
+		udev_trace_record((event), (syspath));			\
+} while (0)
+
+#endif /* UTILS_TRACE_H_ */
@@ -30,7 +30,11 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -44,15 +48,22 @@
 
 #ifdef HAVE_DEVINFO_H
 #include <devinfo.h>
-#include <pthread.h>
+#include <sys/bus.h>
+#include <sys/sysctl.h>
 static pthread_mutex_t devinfo_mtx = PTHREAD_MUTEX_INITIALIZER;
+#ifdef ENABLE_DEVINFO_CACHE
+/* Snapshot kept between scans while kernel device tree is unchanged */
+static bool devinfo_cached = false;
+static int devinfo_generation = -1;
+#endif
 #endif
 
-#ifndef HAVE_PIPE2
-#include <fcntl.h>
+#ifdef __linux__
+#include <sys/syscall.h>
 #endif
 
 #include "utils.h"
+#include "utils-stats.h"
 
 /*
  * locates the occurrence of last component of the pathname
@@ -105,22 +116,85 @@ match_kern_prop_value(const char *buf, const char *prop,
 	return (0);
 }
 
-int
-path_to_fd(const char *path)
+/*
+ * Process-wide index of character device numbers to file descriptors.
+ * It is rebuilt on every lookup miss as the process can open a device at
+ * any moment and exclusive devices can not be opened twice. As
+ * descriptors can be closed or reused behind our back every hit is
+ * revalidated with fstat().
+ */
+struct fd_index_entry {
+	RB_ENTRY(fd_index_entry) link;
+	dev_t rdev;
+	int fd;
+};
+RB_HEAD(fd_index, fd_index_entry);
+
+static int
+fd_index_entry_cmp(struct fd_index_entry *e1, struct fd_index_entry *e2)
+{
+
+	return (e1->rdev < e2->rdev ? -1 : e1->rdev > e2->rdev);
+}
+
+RB_GENERATE(fd_index, fd_index_entry, link, fd_index_entry_cmp);
+
+static struct fd_index fd_index = RB_INITIALIZER(&fd_index);
+static pthread_mutex_t fd_index_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+fd_index_clear(void)
+{
+	struct fd_index_entry *fie1, *fie2;
+
+	RB_FOREACH_SAFE(fie1, fd_index, &fd_index, fie2) {
+		RB_REMOVE(fd_index, &fd_index, fie1);
+		free(fie1);
+	}
+}
+
+static int
+fd_index_add(int fd)
 {
-	int fd = -1;
+	struct fd_index_entry *fie;
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+		return (errno == EBADF ? 0 : -1);
+	if (!S_ISCHR(st.st_mode))
+		return (0);
+
+	fie = calloc(1, sizeof(struct fd_index_entry));
+	if (fie == NULL)
+		return (-1);
+	fie->rdev = st.st_rdev;
+	fie->fd = fd;
+	/* Keep the lowest descriptor if device is opened several times */
+	if (RB_INSERT(fd_index, &fd_index, fie) != NULL)
+		free(fie);
+
+	return (0);
+}
 
+static int
+fd_index_rebuild(void)
+{
+	int fd, ret = 0;
 #ifdef HAVE_LIBPROCSTAT_H
 	struct procstat *procstat;
 	struct kinfo_proc *kip;
 	struct filestat_list *head = NULL;
 	struct filestat *fst;
 	unsigned int count;
+#elif defined(__linux__)
+	DIR *dir;
+	struct dirent *ent;
 #else
-	struct stat st, fst;
 #define	MAX_FD	128
 #endif
 
+	fd_index_clear();
+
 #ifdef HAVE_LIBPROCSTAT_H
 	procstat = procstat_open_sysctl();
 	if (procstat == NULL)
@@ -128,21 +202,24 @@ path_to_fd(const char *path)
 
 	count = 0;
 	kip = procstat_getprocs(procstat, KERN_PROC_PID, getpid(), &count);
-	if (kip == NULL || count != 1)
+	if (kip == NULL || count != 1) {
+		ret = -1;
 		goto out;
+	}
 
 	head = procstat_getfiles(procstat, kip, 0);
-	if (head == NULL)
+	if (head == NULL) {
+		ret = -1;
 		goto out;
+	}
 
 	STAILQ_FOREACH(fst, head, next) {
-		if (fst->fs_uflags == 0 &&
-		    fst->fs_type == PS_FST_TYPE_VNODE &&
-		    fst->fs_path != NULL &&
-		    strcmp(fst->fs_path, path) == 0) {
-			fd = fst->fs_fd;
+		if (fst->fs_uflags != 0 ||
+		    fst->fs_type != PS_FST_TYPE_VNODE ||
+		    (fd = fst->fs_fd) < 0)
+			continue;
+		if ((ret = fd_index_add(fd)) < 0)
 			break;
-		}
 	}
 
 out:
@@ -151,108 +228,330 @@ out:
 	if (kip != NULL)
 		procstat_freeprocs(procstat, kip);
 	procstat_close(procstat);
-#else
-	if (stat(path, &st) != 0)
+#elif defined(__linux__)
+	dir = opendir("/proc/self/fd");
+	if (dir == NULL)
 		return (-1);
 
-	for (fd = 0; fd < MAX_FD; ++fd) {
+	while (ret == 0 && (ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] < '0' || ent->d_name[0] > '9')
+			continue;
+		fd = atoi(ent->d_name);
+		if (fd == dirfd(dir))
+			continue;
+		ret = fd_index_add(fd);
+	}
+	closedir(dir);
+#else
+	for (fd = 0; ret == 0 && fd < MAX_FD; ++fd)
+		ret = fd_index_add(fd);
+#endif
 
-		if (fstat(fd, &fst) != 0) {
-			if (errno != EBADF) {
-				return -1;
-			} else {
-				continue;
-			}
-		}
+	return (ret);
+}
 
-		if (fst.st_rdev == st.st_rdev)
-			break;
+static int
+fd_index_lookup(dev_t rdev)
+{
+	struct fd_index_entry *fie, find;
+	struct stat st;
+
+	find.rdev = rdev;
+	fie = RB_FIND(fd_index, &fd_index, &find);
+	if (fie == NULL)
+		return (-1);
+
+	if (fstat(fie->fd, &st) != 0 ||
+	    !S_ISCHR(st.st_mode) ||
+	    st.st_rdev != rdev) {
+		RB_REMOVE(fd_index, &fd_index, fie);
+		free(fie);
+		return (-1);
 	}
 
-	if (fd == MAX_FD)
+	return (fie->fd);
+}
+
+int
+path_to_fd(const char *path)
+{
+	struct stat st;
+	int fd;
+
+	if (stat(path, &st) != 0 || !S_ISCHR(st.st_mode))
 		return (-1);
-#endif
+
+	pthread_mutex_lock(&fd_index_mtx);
+	fd = fd_index_lookup(st.st_rdev);
+	if (fd == -1 && fd_index_rebuild() == 0)
+		fd = fd_index_lookup(st.st_rdev);
+	pthread_mutex_unlock(&fd_index_mtx);
 
 	return (fd);
 }
 
+#ifdef __linux__
+/* Large getdents64 buffer lets small directories be read in one call */
+#define	SCANDIR_BUFSIZE	(64 * 1024)
+
+struct linux_dirent64 {
+	uint64_t	d_ino;
+	int64_t		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+};
+#endif
+
+/*
+ * State of one scandir_recursive() call. Directory being read is still in
+ * its buffer while subdirectories are walked, so there is one getdents64
+ * buffer per depth. They are allocated once per walk.
+ */
+struct scandir_walk {
+	struct scandir_ctx *ctx;
+	char **bufs;
+	int nbufs;
+};
+
+static int scandir_sub(int dfd, char *path, int off, int rem,
+    struct scandir_walk *walk, int depth);
+
+/* Handles one directory entry. path + off is where its name goes */
 static int
-scandir_sub(char *path, int off, int rem, struct scandir_ctx *ctx)
+scandir_entry(int dfd, const char *name, unsigned char d_type, char *path,
+    int off, int rem, struct scandir_walk *walk, int depth)
 {
-	DIR *dir;
-	struct dirent *ent;
-	int ret = 0;
-
-	dir = opendir(path);
-	if (dir == NULL)
+	struct scandir_ctx *ctx = walk->ctx;
+	struct stat st;
+	mode_t type;
+	int len, fd, ret;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return (0);
+
+	len = strlen(name);
+	if (len > rem)
+		return (0);
+
+	/* Some filesystems do not fill d_type */
+	if (d_type == DT_UNKNOWN) {
+		STATS_INC(backend_syscalls);
+		if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			return (0);
+		type = st.st_mode & S_IFMT;
+	} else
+		type = DTTOIF(d_type);
+
+	memcpy(path + off, name, len + 1);
+	off += len;
+	rem -= len;
+
+	if (!ctx->recursive || !S_ISDIR(type))
+		return ((ctx->cb)(path, dfd, name, type, ctx->args));
+
+	if (rem < 1)
+		return (0);
+	path[off] = '/';
+	path[off + 1] = '\0';
+
+	STATS_INC(backend_syscalls);
+	fd = openat(dfd, name,
+	    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
 		return (errno == ENOMEM ? -1 : 0);
+	/* recurse */
+	ret = scandir_sub(fd, path, off + 1, rem - 1, walk, depth + 1);
+	path[off] = '\0';
+	return (ret);
+}
 
-	while (ret >= 0 && (ent = readdir(dir)) != NULL) {
-		if (strcmp(ent->d_name, ".") == 0 ||
-		    strcmp(ent->d_name, "..") == 0)
-			continue;
+#ifdef __linux__
+static char *
+scandir_buf(struct scandir_walk *walk, int depth)
+{
+	char **bufs;
 
-		int len = strlen(ent->d_name);
-		if (len > rem)
-			continue;
+	if (depth < walk->nbufs)
+		return (walk->bufs[depth]);
+
+	bufs = realloc(walk->bufs, (depth + 1) * sizeof(char *));
+	if (bufs == NULL)
+		return (NULL);
+	walk->bufs = bufs;
+	walk->bufs[depth] = malloc(SCANDIR_BUFSIZE);
+	if (walk->bufs[depth] == NULL)
+		return (NULL);
+	walk->nbufs = depth + 1;
+	return (walk->bufs[depth]);
+}
+#endif
 
-		strcpy(path + off, ent->d_name);
-		off += len;
-		rem -= len;
+/* Walks directory opened as dfd. Takes ownership of dfd */
+static int
+scandir_sub(int dfd, char *path, int off, int rem, struct scandir_walk *walk,
+    int depth)
+{
+#ifdef __linux__
+	struct linux_dirent64 *ent;
+	char *buf;
+	long n, pos;
+#else
+	DIR *dir;
+	struct dirent *ent;
+#endif
+	int ret = 0;
 
-		if ((ctx->recursive) && (ent->d_type == DT_DIR)) {
-			if (rem < 1)
-				break;
-			path[off] = '/';
-			path[off+1] = '\0';
-			off++;
-			rem--;
-			/* recurse */
-			ret = scandir_sub(path, off, rem, ctx);
-			off--;
-			rem++;
-		} else {
-			ret = (ctx->cb)(path, DTTOIF(ent->d_type), ctx->args);
+#ifdef __linux__
+	buf = scandir_buf(walk, depth);
+	if (buf == NULL) {
+		close(dfd);
+		return (-1);
+	}
+	while (ret >= 0 &&
+	    (n = syscall(SYS_getdents64, dfd, buf, SCANDIR_BUFSIZE)) > 0) {
+		STATS_INC(backend_syscalls);
+		for (pos = 0; ret >= 0 && pos < n; pos += ent->d_reclen) {
+			ent = (struct linux_dirent64 *)(buf + pos);
+			ret = scandir_entry(dfd, ent->d_name, ent->d_type,
+			    path, off, rem, walk, depth);
 		}
-		off -= len;
-		rem += len;
 	}
+	/* Read error is not end of directory */
+	if (ret >= 0 && n < 0)
+		ret = -1;
+	close(dfd);
+#else
+	dir = fdopendir(dfd);
+	if (dir == NULL) {
+		close(dfd);
+		return (errno == ENOMEM ? -1 : 0);
+	}
+	/* readdir() reads in batches, small directory takes one call */
+	STATS_INC(backend_syscalls);
+	errno = 0;
+	while (ret >= 0 && (ent = readdir(dir)) != NULL) {
+		ret = scandir_entry(dfd, ent->d_name, ent->d_type, path, off,
+		    rem, walk, depth);
+		errno = 0;
+	}
+	if (ret >= 0 && errno != 0)
+		ret = -1;
 	closedir(dir);
+#endif
 	return (ret);
 }
 
 int
 scandir_recursive(char *path, size_t len, struct scandir_ctx *ctx)
 {
+	struct scandir_walk walk = { .ctx = ctx };
 	size_t root_len = strlen(path);
+	int dfd, i, ret;
 
-	return (scandir_sub(path, root_len, len - root_len - 1, ctx));
+	STATS_INC(backend_syscalls);
+	dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0)
+		return (errno == ENOMEM ? -1 : 0);
+
+	ret = scandir_sub(dfd, path, root_len, len - root_len - 1, &walk, 0);
+	for (i = 0; i < walk.nbufs; i++)
+		free(walk.bufs[i]);
+	free(walk.bufs);
+	return (ret);
 }
 
 #ifdef HAVE_DEVINFO_H
+struct scandev_args {
+	struct scandev_ctx *ctx;
+	size_t nctx;
+};
+
 static int
 scandev_sub(struct devinfo_dev *dev, void *args)
 {
-	struct scandev_ctx *ctx = args;
+	struct scandev_args *sa = args;
+	size_t i;
 
-	if ((ctx->cb)(dev, ctx->args) < 0)
+	for (i = 0; i < sa->nctx; i++)
+		if ((sa->ctx[i].cb)(dev, sa->ctx[i].args) < 0)
 			return (-1);
 
 	/* recurse */
-        return (devinfo_foreach_device_child(dev, scandev_sub, args));
+	return (devinfo_foreach_device_child(dev, scandev_sub, args));
+}
+
+/* Returns generation of kernel device tree, -1 if unknown */
+int
+scandev_generation(void)
+{
+	struct u_businfo ubus;
+	size_t ub_size = sizeof(ubus);
+
+	STATS_INC(backend_syscalls);
+	if (sysctlbyname("hw.bus.info", &ubus, &ub_size, NULL, 0) != 0)
+		return (-1);
+
+	return (ubus.ub_generation);
+}
+
+/* Takes devinfo snapshot or reuses cached one. Called with devinfo_mtx held */
+static int
+scandev_snapshot(void)
+{
+#ifdef ENABLE_DEVINFO_CACHE
+	int generation;
+
+	generation = scandev_generation();
+	if (devinfo_cached) {
+		if (generation >= 0 && generation == devinfo_generation)
+			return (0);
+		devinfo_free();
+		devinfo_cached = false;
+	}
+#endif
+
+	STATS_INC(backend_syscalls);
+	if (devinfo_init()) {
+		ERR("devinfo_init failed");
+		return (-1);
+	}
+
+#ifdef ENABLE_DEVINFO_CACHE
+	devinfo_cached = generation >= 0;
+	devinfo_generation = generation;
+#endif
+	return (0);
 }
 
+static void
+scandev_release(void)
+{
 
+#ifdef ENABLE_DEVINFO_CACHE
+	if (devinfo_cached)
+		return;
+#endif
+	devinfo_free();
+}
+
+/*
+ * Walks kernel device tree once calling every callback from ctx array
+ * for each device. Walk is stopped if any of callbacks returns -1.
+ */
 int
-scandev_recursive (struct scandev_ctx *ctx)
+scandev_recursive(struct scandev_ctx *ctx, size_t nctx)
 {
+	struct scandev_args sa = {
+		.ctx = ctx,
+		.nctx = nctx,
+	};
 	struct devinfo_dev *root;
 	int ret;
 
 	pthread_mutex_lock(&devinfo_mtx);
-	if (devinfo_init()) {
+	if (scandev_snapshot() < 0) {
 		pthread_mutex_unlock(&devinfo_mtx);
-		ERR("devinfo_init failed");
 		return (-1);
 	}
 
@@ -260,15 +559,30 @@ scandev_recursive (struct scandev_ctx *ctx)
 		ERR("faled to init devinfo root device");
 		ret = -1;
 	} else {
-		ret = devinfo_foreach_device_child(root, scandev_sub, ctx);
+		ret = devinfo_foreach_device_child(root, scandev_sub, &sa);
 		if (ret < 0)
 			ERR("devinfo_foreach_device_child failed");
 	}
 
-	devinfo_free();
+	scandev_release();
 	pthread_mutex_unlock(&devinfo_mtx);
 	return (ret);
 }
+
+/* Drops cached devinfo snapshot, if any */
+void
+scandev_invalidate(void)
+{
+
+#ifdef ENABLE_DEVINFO_CACHE
+	pthread_mutex_lock(&devinfo_mtx);
+	if (devinfo_cached) {
+		devinfo_free();
+		devinfo_cached = false;
+	}
+	pthread_mutex_unlock(&devinfo_mtx);
+#endif
+}
 #endif /* HAVE_DEVINFO_H */
 
 #ifndef HAVE_DEVNAME_R
@@ -280,13 +594,14 @@ struct devname_scan_args {
 };
 
 static int
-devname_cb(const char *path, mode_t type, void *args)
+devname_cb(const char *path, int dirfd, const char *name, mode_t type,
+    void *args)
 {
 	struct devname_scan_args *sa = args;
 	struct stat st;
 
 	if (sa->type == type &&
-	    lstat(path, &st) == 0 &&
+	    fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
 	    st.ST_RDEV == sa->dev) {
 		strlcpy(sa->buf, path + 5, sa->len);
 		return (-1);
@@ -345,6 +660,23 @@ pipe2(int fildes[2], int flags)
 }
 #endif /* !HAVE_PIPE2 */
 
+#ifndef HAVE_SECURE_GETENV
+/* Environment is not trusted in set-user-ID and set-group-ID programs */
+char *
+secure_getenv(const char *name)
+{
+
+#ifdef HAVE_ISSETUGID
+	if (issetugid())
+		return (NULL);
+#else
+	if (getuid() != geteuid() || getgid() != getegid())
+		return (NULL);
+#endif
+	return (getenv(name));
+}
+#endif /* !HAVE_SECURE_GETENV */
+
 #ifndef HAVE_STRCHRNUL
 char *
 strchrnul(const char *p, int ch)
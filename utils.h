@@ -31,6 +31,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <syslog.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -41,36 +42,26 @@
 #include "tree.h"
 #endif
 
-/* #define	ENABLE_TRACE */
-#define	LOG_LEVEL       0
-
 /*
-#ifndef	LOG_LEVEL
-#define	LOG_LEVEL -1
-#endif
-*/
-#ifdef ENABLE_TRACE
-#define	TRC(msg, ...)							\
-do {									\
-	int saved_errno_ = errno;					\
-	fprintf(stderr, "%s" msg "\n", __FUNCTION__, ##__VA_ARGS__);	\
-	errno = saved_errno_;						\
-} while (0)
-#else
-#define	TRC(msg, ...)
-#endif
+ * Messages are passed to log functions of udev contexts whose priority
+ * allows it. udev_log_priority_max is the highest priority among them,
+ * so disabled messages cost one branch and their arguments are not
+ * evaluated.
+ */
+extern int udev_log_priority_max;
 
-#define LOG(level, msg, ...) do {					\
-	if (level < LOG_LEVEL) {					\
-		if (level == 0 && errno != 0)				\
-			fprintf(stderr, msg" %d(%s)\n", ##__VA_ARGS__,	\
-			    errno, strerror(errno));			\
-		else							\
-			fprintf(stderr, msg"\n", ##__VA_ARGS__);	\
-	}								\
+void udev_log(int priority, const char *file, int line, const char *fn,
+    const char *format, ...) __attribute__((format(printf, 5, 6)));
+
+#define	LOG(level, msg, ...) do {					\
+	if (__builtin_expect(__atomic_load_n(&udev_log_priority_max,	\
+	    __ATOMIC_RELAXED) >= (level), 0))				\
+		udev_log((level), __FILE__, __LINE__, __func__,	\
+		    msg, ##__VA_ARGS__);				\
 } while (0)
-#define	ERR(...)	LOG(0, __VA_ARGS__)
-#define	DBG(...)	LOG(1, __VA_ARGS__)
+#define	TRC(msg, ...)	LOG(LOG_DEBUG, "%s" msg, __func__, ##__VA_ARGS__)
+#define	ERR(...)	LOG(LOG_ERR, __VA_ARGS__)
+#define	DBG(...)	LOG(LOG_INFO, __VA_ARGS__)
 
 #define	UNIMPL()	ERR("%s is unimplemented", __FUNCTION__)
 
@@ -92,7 +83,10 @@ do {									\
 #define	ST_RDEV	st_rdev
 #endif
 
-typedef int (* scandir_cb_t)(const char *path, mode_t type, void *args);
+/* Callback gets full path, and also parent dirfd and entry name to be
+ * used with *at() calls instead of resolving full path once more. */
+typedef int (* scandir_cb_t)(const char *path, int dirfd, const char *name,
+    mode_t type, void *args);
 
 /* If .recursive is true, then .cb gets called for non-dir
  * paths, an the overall scandir is recursive. If .recursive
@@ -117,7 +111,9 @@ struct scandev_ctx {
 	scandev_cb_t cb;
 	void *args;
 };
-int scandev_recursive(struct scandev_ctx *ctx);
+int scandev_recursive(struct scandev_ctx *ctx, size_t nctx);
+void scandev_invalidate(void);
+int scandev_generation(void);
 #endif
 #ifndef HAVE_DEVNAME_R
 char *devname_r(dev_t dev, mode_t type, char *buf, int len);
@@ -125,6 +121,9 @@ char *devname_r(dev_t dev, mode_t type, char *buf, int len);
 #ifndef HAVE_PIPE2
 int pipe2(int fildes[2], int flags);
 #endif
+#ifndef HAVE_SECURE_GETENV
+char *secure_getenv(const char *name);
+#endif
 #ifndef HAVE_STRCHRNUL
 char *strchrnul(const char *p, int ch);
 #endif